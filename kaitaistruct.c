@@ -1,295 +1,1561 @@
+#if defined(__unix__) || defined(__APPLE__)
+#define KS_HAVE_POSIX
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+#define _FILE_OFFSET_BITS 64
+
 #define KS_DEPEND_ON_INTERNALS
+#ifndef KS_NO_INLINE_READS
+#define KS_NO_INLINE_READS
+#endif
 #include "kaitaistruct.h"
 
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define KS_HAVE_X86_DISPATCH
+#endif
+
+#ifdef KS_HAVE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+#ifdef KS_HAVE_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#endif
+
 #define VOID
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #define max(a,b) (((a) > (b)) ? (a) : (b))
 
-#define REVERSE_FUNC(type) \
-    static void reverse_##type(type* data, int len) { \
-        int start = 0, end = len - 1; \
-        while (start < end) { \
-            type temp = data[start]; \
-            data[start] = data[end]; \
-            data[end] = temp; \
-            start++; \
-            end--; \
-        } \
+static void* default_alloc(void* userdata, uint64_t size)
+{
+    (void)userdata;
+    return malloc(size);
+}
+
+static void* default_realloc(void* userdata, void* data, uint64_t size)
+{
+    (void)userdata;
+    return realloc(data, size);
+}
+
+static void default_free(void* userdata, void* data)
+{
+    (void)userdata;
+    free(data);
+}
+
+static const ks_allocator default_allocator = {0, default_alloc, default_realloc, default_free};
+
+void* ks_scratch_alloc(ks_config* config, uint64_t len)
+{
+    return config->allocator.alloc(config->allocator.userdata, len);
+}
+
+void* ks_scratch_realloc(ks_config* config, void* data, uint64_t len)
+{
+    return config->allocator.realloc(config->allocator.userdata, data, len);
+}
+
+void ks_scratch_free(ks_config* config, void* data)
+{
+    if (data)
+    {
+        config->allocator.free(config->allocator.userdata, data);
+    }
+}
+
+static ks_memory_page* page_create(ks_config* config, uint64_t size)
+{
+    ks_memory_page* page = ks_scratch_alloc(config, KS_MEMORY_PAGE_HEADER + size);
+    if (!page)
+    {
+        return 0;
+    }
+    page->prev = 0;
+    page->next = 0;
+    page->size = size;
+    page->used = 0;
+    return page;
+}
+
+static uint8_t* page_data(ks_memory_page* page)
+{
+    return (uint8_t*)page + KS_MEMORY_PAGE_HEADER;
+}
+
+static void page_insert_before(ks_config* config, ks_memory_page* page, ks_memory_page* page_new)
+{
+    page_new->next = page;
+    page_new->prev = page->prev;
+    if (page->prev)
+    {
+        page->prev->next = page_new;
+    }
+    else
+    {
+        config->page_start = page_new;
     }
+    page->prev = page_new;
+}
 
-REVERSE_FUNC(uint8_t);
+static void page_insert_after(ks_memory_page* page, ks_memory_page* page_new)
+{
+    page_new->prev = page;
+    page_new->next = page->next;
+    if (page->next)
+    {
+        page->next->prev = page_new;
+    }
+    page->next = page_new;
+}
 
-static void** ks_alloc_internal(ks_config* config, uint64_t len)
+static ks_memory_page* page_find(ks_config* config, uint64_t size)
 {
-    void** ret;
-    ks_memory_info* meminfo = config->meminfo_current;
-    if (meminfo->count >= KS_MAX_MEMINFO)
+    ks_memory_page* page = config->page_current;
+    ks_memory_page* page_new;
+    ks_bool large = size > KS_MEMORY_PAGE_SIZE / 4;
+
+    if (size <= page->size - page->used)
     {
-        meminfo->next = calloc(1, sizeof(ks_memory_info));
-        meminfo = meminfo->next;
-        config->meminfo_current = meminfo;
+        return page;
     }
-    ret = &meminfo->data[meminfo->count];
-    meminfo->data[meminfo->count++] = calloc(1, len);
-    return ret;
+
+    /* Pages behind the current one are kept from before ks_config_reset */
+    for (page_new = page->next; page_new; page_new = page_new->next)
+    {
+        if (size <= page_new->size - page_new->used)
+        {
+            if (!large)
+            {
+                config->page_current = page_new;
+            }
+            return page_new;
+        }
+    }
+
+    page_new = page_create(config, large ? size : KS_MEMORY_PAGE_SIZE);
+    if (!page_new)
+    {
+        KS_ERROR(config, "Failed to allocate memory page", KS_ERROR_OTHER);
+        return 0;
+    }
+    config->memory.reserved_bytes += KS_MEMORY_PAGE_HEADER + page_new->size;
+
+    /* Large blocks get a page of their own, filed before the current page so it keeps serving small objects */
+    if (large)
+    {
+        page_insert_before(config, page, page_new);
+    }
+    else
+    {
+        page_insert_after(page, page_new);
+        config->page_current = page_new;
+    }
+    return page_new;
+}
+
+static ks_memory_block* block_get(void* data)
+{
+    return (ks_memory_block*)((uint8_t*)data - KS_MEMORY_BLOCK_HEADER);
+}
+
+static ks_bool block_is_last(ks_memory_block* block)
+{
+    return (uint8_t*)block + KS_MEMORY_BLOCK_HEADER + block->size == page_data(block->page) + block->page->used;
+}
+
+static ks_bool memory_fits(const ks_config* config, uint64_t size)
+{
+    uint64_t live = config->memory.live_bytes;
+    return !config->memory_limit || (live <= config->memory_limit && size <= config->memory_limit - live);
+}
+
+static ks_bool memory_reserve(ks_config* config, uint64_t size)
+{
+    ks_memory_stats* stats = &config->memory;
+
+    if (!memory_fits(config, size))
+    {
+        KS_ERROR(config, "Memory limit exceeded", KS_ERROR_MEMORY_LIMIT);
+        return 0;
+    }
+
+    stats->live_bytes += size;
+    if (stats->live_bytes > stats->peak_bytes)
+    {
+        stats->peak_bytes = stats->live_bytes;
+    }
+    return 1;
 }
 
 void* ks_alloc(ks_config* config, uint64_t len)
 {
-    return *ks_alloc_internal(config, len);
+    uint64_t size = KS_MEMORY_BLOCK_HEADER + KS_MEMORY_ALIGN_UP(len);
+    ks_memory_page* page;
+    ks_memory_block* block;
+
+    if (size < len)
+    {
+        KS_ERROR(config, "Memory limit exceeded", KS_ERROR_MEMORY_LIMIT);
+        return 0;
+    }
+    if (!memory_reserve(config, size - KS_MEMORY_BLOCK_HEADER))
+    {
+        return 0;
+    }
+
+    page = page_find(config, size);
+    if (!page)
+    {
+        config->memory.live_bytes -= size - KS_MEMORY_BLOCK_HEADER;
+        return 0;
+    }
+    config->memory.alloc_count++;
+
+    block = (ks_memory_block*)(page_data(page) + page->used);
+    block->page = page;
+    block->size = size - KS_MEMORY_BLOCK_HEADER;
+    block->magic = KS_MEMORY_BLOCK_MAGIC;
+    page->used += size;
+    memset((uint8_t*)block + KS_MEMORY_BLOCK_HEADER, 0, block->size);
+    return (uint8_t*)block + KS_MEMORY_BLOCK_HEADER;
+}
+
+static void* block_realloc_page(ks_config* config, ks_memory_block* block, uint64_t size)
+{
+    ks_memory_page* page = block->page;
+    ks_memory_page* page_new;
+    uint64_t grow = size - block->size;
+    uint64_t page_size = page->size; /* The block may not have filled its page */
+
+    if (!memory_reserve(config, grow))
+    {
+        return 0;
+    }
+
+    page_new = ks_scratch_realloc(config, page, KS_MEMORY_PAGE_HEADER + KS_MEMORY_BLOCK_HEADER + size);
+    if (!page_new)
+    {
+        config->memory.live_bytes -= grow;
+        KS_ERROR(config, "Failed to grow memory page", KS_ERROR_REALLOC_FAILED);
+        return 0;
+    }
+    config->memory.reserved_bytes += KS_MEMORY_BLOCK_HEADER + size - page_size;
+
+    if (page_new->prev)
+    {
+        page_new->prev->next = page_new;
+    }
+    else
+    {
+        config->page_start = page_new;
+    }
+    if (page_new->next)
+    {
+        page_new->next->prev = page_new;
+    }
+    if (config->page_current == page)
+    {
+        config->page_current = page_new;
+    }
+
+    block = (ks_memory_block*)page_data(page_new);
+    memset((uint8_t*)block + KS_MEMORY_BLOCK_HEADER + block->size, 0, size - block->size);
+    block->page = page_new;
+    block->size = size;
+    page_new->size = page_new->used = KS_MEMORY_BLOCK_HEADER + size;
+    return (uint8_t*)block + KS_MEMORY_BLOCK_HEADER;
 }
 
 void* ks_realloc(ks_config* config, void* old, uint64_t len)
 {
-    ks_memory_info* meminfo = config->meminfo_start;
+    ks_memory_block* block;
+    ks_memory_page* page;
+    uint64_t size = KS_MEMORY_ALIGN_UP(len);
+    void* ret;
+
     if (!old)
     {
-        config->meminfo_last_realloc = ks_alloc_internal(config, len);
-        return *config->meminfo_last_realloc;
+        return ks_alloc(config, len);
+    }
+
+    if (size < len)
+    {
+        KS_ERROR(config, "Memory limit exceeded", KS_ERROR_MEMORY_LIMIT);
+        return 0;
+    }
+
+    block = block_get(old);
+    if (block->magic != KS_MEMORY_BLOCK_MAGIC)
+    {
+        KS_ERROR(config, "Can't realloc data that was not allocated using ks_alloc/ks_realloc!", KS_ERROR_REALLOC_FAILED);
+        return 0;
+    }
+    if (size <= block->size)
+    {
+        return old;
     }
+    config->memory.realloc_count++;
 
-    if (config->meminfo_last_realloc && *config->meminfo_last_realloc == old)
+    /* Grow geometrically, so repeated appends cost amortized O(1). Only the requested size has to fit the limit */
+    if (size < block->size * 2 && memory_fits(config, block->size * 2 - block->size))
     {
-        *config->meminfo_last_realloc = realloc(old, len);
-        return *config->meminfo_last_realloc;
+        size = block->size * 2;
     }
 
-    /* Fallback, search memory in whole list */
-    while (meminfo)
+    page = block->page;
+    if (block_is_last(block))
     {
-        int i;
-        for (i = 0; i < meminfo->count; i++)
+        if (size - block->size <= page->size - page->used)
         {
-           if (meminfo->data[i] == old)
-           {
-               void* ret = realloc(old, len);
-               meminfo->data[i] = ret;
-               config->meminfo_last_realloc = &meminfo->data[i];
-               return ret;
-           }
+            if (!memory_reserve(config, size - block->size))
+            {
+                return 0;
+            }
+            memset((uint8_t*)old + block->size, 0, size - block->size);
+            page->used += size - block->size;
+            block->size = size;
+            return old;
+        }
+        if ((uint8_t*)block == page_data(page))
+        {
+            return block_realloc_page(config, block, size);
         }
-        meminfo = meminfo->next;
     }
 
-    /* Should never happen */
-
-    KS_ERROR(config, "Can't realloc data that was not allocated using ks_alloc/ks_realloc!", KS_ERROR_REALLOC_FAILED);
-    return 0;
+    /* The old block is released by the move, so only the growth counts against the limit */
+    config->memory.live_bytes -= block->size;
+    ret = ks_alloc(config, size);
+    if (!ret)
+    {
+        config->memory.live_bytes += block->size;
+        return 0;
+    }
+    memcpy(ret, old, block->size);
+    return ret;
 }
 
-ks_config* ks_config_create_internal(ks_log log, ks_ptr_inflate inflate, ks_ptr_str_decode str_decode)
+ks_config* ks_config_create_internal(ks_log log, ks_ptr_inflate inflate, const ks_inflater* inflater, ks_ptr_str_decode str_decode, const ks_allocator* allocator)
 {
-    ks_config* config = calloc(1, sizeof(ks_config));
+    ks_config* config;
+
+    if (!allocator)
+    {
+        allocator = &default_allocator;
+    }
+
+    config = allocator->alloc(allocator->userdata, sizeof(ks_config));
+    if (!config)
+    {
+        return 0;
+    }
+    memset(config, 0, sizeof(ks_config));
+    config->allocator = *allocator;
     config->inflate = inflate;
+    if (inflater)
+    {
+        config->inflater = *inflater;
+    }
     config->str_decode = str_decode;
     config->log = log;
-    config->fake_stream = calloc(1, sizeof(ks_stream));
+    config->file_window_size = KS_FILE_WINDOW_SIZE;
+    config->fake_stream = ks_scratch_alloc(config, sizeof(ks_stream));
+    config->page_start = page_create(config, KS_MEMORY_PAGE_SIZE);
+    if (!config->fake_stream || !config->page_start)
+    {
+        ks_config_destroy(config);
+        return 0;
+    }
+    memset(config->fake_stream, 0, sizeof(ks_stream));
     config->fake_stream->config = config;
-    config->meminfo_start = calloc(1, sizeof(ks_memory_info));
-    config->meminfo_current = config->meminfo_start;
+    config->page_current = config->page_start;
+    config->memory.reserved_bytes = KS_MEMORY_PAGE_HEADER + KS_MEMORY_PAGE_SIZE;
     return config;
 }
 
+static ks_bool config_add_cleanup(ks_config* config, ks_callback func, void* data)
+{
+    ks_cleanup* cleanup = ks_alloc(config, sizeof(ks_cleanup));
+    if (!cleanup)
+    {
+        return 0;
+    }
+    cleanup->func = func;
+    cleanup->data = data;
+    cleanup->next = config->cleanup;
+    config->cleanup = cleanup;
+    return 1;
+}
+
+static ks_bool config_add_cleanup_persistent(ks_config* config, ks_callback func, void* data)
+{
+    ks_cleanup* cleanup = ks_scratch_alloc(config, sizeof(ks_cleanup));
+    if (!cleanup)
+    {
+        return 0;
+    }
+    cleanup->func = func;
+    cleanup->data = data;
+    cleanup->next = config->cleanup_persistent;
+    config->cleanup_persistent = cleanup;
+    return 1;
+}
+
+/* Runs and removes the persistent cleanup of data ahead of ks_config_destroy */
+static void config_run_cleanup_persistent(ks_config* config, void* data)
+{
+    ks_cleanup** link;
+    for (link = &config->cleanup_persistent; *link; link = &(*link)->next)
+    {
+        ks_cleanup* cleanup = *link;
+        if (cleanup->data == data)
+        {
+            *link = cleanup->next;
+            cleanup->func(cleanup->data);
+            ks_scratch_free(config, cleanup);
+            return;
+        }
+    }
+}
+
+static void config_run_cleanup(ks_config* config)
+{
+    ks_cleanup* cleanup;
+    for (cleanup = config->cleanup; cleanup; cleanup = cleanup->next)
+    {
+        cleanup->func(cleanup->data);
+    }
+    config->cleanup = 0;
+}
+
 void ks_config_destroy(ks_config* config)
 {
-    ks_memory_info* meminfo = config->meminfo_start;
-    while (meminfo)
+    config_run_cleanup(config);
+    if (config->inflate_state)
+    {
+        config->inflater.end(config, config->inflate_state);
+    }
+    while (config->cleanup_persistent)
+    {
+        ks_cleanup* next = config->cleanup_persistent->next;
+        config->cleanup_persistent->func(config->cleanup_persistent->data);
+        ks_scratch_free(config, config->cleanup_persistent);
+        config->cleanup_persistent = next;
+    }
+    while (config->page_start)
+    {
+        ks_memory_page* next = config->page_start->next;
+        ks_scratch_free(config, config->page_start);
+        config->page_start = next;
+    }
+    ks_scratch_free(config, config->fake_stream);
+    ks_scratch_free(config, config);
+}
+
+void ks_config_reset(ks_config* config)
+{
+    ks_memory_page* page;
+
+    config_run_cleanup(config);
+    for (page = config->page_start; page; page = page->next)
+    {
+        page->used = 0;
+    }
+    config->page_current = config->page_start;
+    config->memory.live_bytes = 0;
+
+    memset(config->fake_stream, 0, sizeof(ks_stream));
+    config->fake_stream->config = config;
+    config->error = KS_ERROR_OKAY;
+}
+
+void ks_config_set_file_window(ks_config* config, uint64_t size)
+{
+    config->file_window_size = size > 0 ? size : KS_FILE_WINDOW_SIZE;
+}
+
+void ks_config_set_readahead(ks_config* config, uint64_t size)
+{
+    config->readahead_size = size;
+}
+
+void ks_config_set_array_aliasing(ks_config* config, ks_bool enable)
+{
+    config->array_aliasing = enable;
+}
+
+void ks_config_set_memory_limit(ks_config* config, uint64_t limit)
+{
+    config->memory_limit = limit;
+}
+
+void ks_config_get_memory_stats(ks_config* config, ks_memory_stats* stats)
+{
+    *stats = config->memory;
+}
+
+/* Hands out the idle state if there is one, setting an inflater up costs more than the data of small fields */
+static void* config_inflate_begin(ks_config* config)
+{
+    void* state = config->inflate_state;
+
+    if (!config->inflater.begin)
+    {
+        KS_ERROR(config, "Zlib support missing", KS_ERROR_ZLIB_MISSING);
+        return 0;
+    }
+    if (state)
     {
-        int i;
-        void* last = meminfo;
-        for (i = 0; i < meminfo->count; i++)
+        config->inflate_state = 0;
+        if (config->inflater.reset(state) == KS_ERROR_OKAY)
         {
-            free(meminfo->data[i]);
+            return state;
         }
-        meminfo = meminfo->next;
-        free(last);
+        config->inflater.end(config, state);
+    }
+
+    state = config->inflater.begin(config);
+    if (!state)
+    {
+        KS_ERROR(config, "Failed to start inflating", KS_ERROR_ZLIB);
+    }
+    return state;
+}
+
+static void config_inflate_end(ks_config* config, void* state)
+{
+    if (!config->inflate_state)
+    {
+        config->inflate_state = state;
+        return;
     }
-    free(config->fake_stream);
-    free(config);
+    config->inflater.end(config, state);
+}
+
+static void handle_init(ks_handle* handle, ks_stream* stream, void* data, ks_type type, int type_size, ks_usertype_generic* parent)
+{
+    handle->stream = stream;
+    handle->pos = stream ? stream->pos : 0;
+    handle->data = data;
+    handle->type = type;
+    handle->type_size = type_size;
+    handle->parent = parent;
 }
 
 ks_handle* ks_handle_create(ks_stream* stream, void* data, ks_type type, int type_size, int internal_read_size, ks_usertype_generic* parent)
 {
     ks_handle* ret = ks_alloc(stream->config, sizeof(ks_handle));
 
-    ret->stream = stream;
-    ret->pos = stream ? stream->pos : 0;
-    ret->data = data;
-    ret->type = type;
-    ret->type_size = type_size;
+    if (!ret)
+    {
+        return 0;
+    }
+
+    handle_init(ret, stream, data, type, type_size, parent);
     if (internal_read_size != 0)
     {
         ret->internal_read = ks_alloc(stream->config, internal_read_size);
+        if (!ret->internal_read)
+        {
+            return 0;
+        }
+    }
+
+    return ret;
+}
+
+/* Places object, handle, internal_read and an optional tail in one block, tail can't be passed to ks_realloc */
+static void* usertype_alloc(ks_stream* stream, int size, ks_type type, int type_size, int internal_read_size, ks_usertype_generic* parent, uint64_t tail_size, void** tail)
+{
+    uint64_t offset_handle = KS_OBJECT_ALIGN_UP(size);
+    uint64_t offset_internal = offset_handle + KS_OBJECT_ALIGN_UP(sizeof(ks_handle));
+    uint64_t offset_tail = offset_internal + KS_OBJECT_ALIGN_UP(internal_read_size);
+    uint8_t* ret = ks_alloc(stream->config, offset_tail + tail_size);
+    ks_handle* handle;
+
+    if (!ret)
+    {
+        return 0;
     }
-    ret->parent = parent;
 
+    handle = (ks_handle*)(ret + offset_handle);
+    handle_init(handle, stream, ret, type, type_size, parent);
+    if (internal_read_size != 0)
+    {
+        handle->internal_read = ret + offset_internal;
+    }
+    if (tail)
+    {
+        *tail = ret + offset_tail;
+    }
+    HANDLE(ret) = handle;
     return ret;
 }
 
-ks_stream* ks_stream_create_from_file(FILE* file, ks_config* config)
+void* ks_usertype_create(ks_stream* stream, int size, ks_type type, int type_size, int internal_read_size, ks_usertype_generic* parent)
+{
+    return usertype_alloc(stream, size, type, type_size, internal_read_size, parent, 0, 0);
+}
+
+static ks_bytes* bytes_create(ks_stream* stream)
+{
+    return usertype_alloc(stream, sizeof(ks_bytes), KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0, 0, 0);
+}
+
+static ks_bytes* bytes_create_direct(ks_stream* stream, uint64_t length)
+{
+    void* data;
+    ks_bytes* ret = usertype_alloc(stream, sizeof(ks_bytes), KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0, length, &data);
+    if (!ret)
+    {
+        return 0;
+    }
+
+    ret->data_direct = data;
+    ret->length = length;
+    return ret;
+}
+
+static ks_string* string_create(ks_stream* stream, uint64_t len)
+{
+    void* data;
+    ks_string* ret = usertype_alloc(stream, sizeof(ks_string), KS_TYPE_STRING, sizeof(ks_string), 0, 0, len + 1, &data); /* Alloc one more for null terminator */
+    if (!ret)
+    {
+        return 0;
+    }
+
+    ret->data = data;
+    ret->len = len;
+    return ret;
+}
+
+static int file_seek(FILE* file, uint64_t offset, int whence)
+{
+#if defined(KS_HAVE_POSIX)
+    return fseeko(file, offset, whence);
+#elif defined(_WIN32)
+    return _fseeki64(file, offset, whence);
+#else
+    return fseek(file, offset, whence);
+#endif
+}
+
+static int64_t file_tell(FILE* file)
+{
+#if defined(KS_HAVE_POSIX)
+    return ftello(file);
+#elif defined(_WIN32)
+    return _ftelli64(file);
+#else
+    return ftell(file);
+#endif
+}
+
+static ks_stream* stream_create_with_source(ks_config* config, ks_source_type type)
+{
+    ks_stream* ret = ks_alloc(config, sizeof(ks_stream));
+    if (!ret)
+    {
+        return 0;
+    }
+    ret->config = config;
+    ret->source = ks_alloc(config, sizeof(ks_stream_source));
+    if (!ret->source)
+    {
+        return 0;
+    }
+    ret->source->type = type;
+    ret->source->window_size = config->file_window_size;
+    ret->source->readahead_size = config->readahead_size;
+    ret->source->window = ks_alloc(config, config->file_window_size);
+    if (!ret->source->window)
+    {
+        return 0;
+    }
+    return ret;
+}
+
+ks_stream* ks_stream_create_from_file(FILE* file, ks_config* config)
+{
+    ks_stream* ret;
+    int64_t length;
+
+    if (!file || file_seek(file, 0, SEEK_END) != 0 || (length = file_tell(file)) < 0)
+    {
+        return 0;
+    }
+
+    ret = stream_create_with_source(config, KS_SOURCE_FILE);
+    if (!ret)
+    {
+        return 0;
+    }
+    ret->source->file = file;
+    ret->length = length;
+    ret->source->length = ret->length;
+    return ret;
+}
+
+ks_stream* ks_stream_create_from_pipe(FILE* file, ks_config* config)
+{
+    ks_stream* ret;
+
+    if (!file)
+    {
+        return 0;
+    }
+
+    ret = stream_create_with_source(config, KS_SOURCE_PIPE);
+    if (!ret)
+    {
+        return 0;
+    }
+    ret->source->file = file;
+    ret->length = KS_LENGTH_UNKNOWN;
+    return ret;
+}
+
+static void zlib_source_free(void* data)
+{
+    ks_stream* stream = data;
+    config_inflate_end(stream->config, stream->source->inflate_state);
+}
+
+ks_stream* ks_stream_create_from_zlib(ks_bytes* bytes)
+{
+    ks_config* config = HANDLE(bytes)->stream->config;
+    const uint8_t* input;
+    uint64_t input_length;
+    ks_stream* ret;
+
+    input = ks_bytes_get_view(bytes, &input_length);
+    if (!input)
+    {
+        return 0;
+    }
+
+    ret = stream_create_with_source(config, KS_SOURCE_ZLIB);
+    if (!ret)
+    {
+        return 0;
+    }
+    ret->source->input = input;
+    ret->source->input_length = input_length;
+    ret->source->inflate_state = config_inflate_begin(config);
+    if (!ret->source->inflate_state)
+    {
+        return 0;
+    }
+    if (!config_add_cleanup(config, zlib_source_free, ret))
+    {
+        config_inflate_end(config, ret->source->inflate_state);
+        return 0;
+    }
+    ret->length = KS_LENGTH_UNKNOWN;
+    return ret;
+}
+
+ks_stream* ks_stream_create_from_fd(int fd, ks_config* config)
+{
+#ifdef KS_HAVE_POSIX
+    ks_stream* ret;
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        return 0;
+    }
+
+    ret = stream_create_with_source(config, KS_SOURCE_FD);
+    if (!ret)
+    {
+        return 0;
+    }
+    ret->source->fd = fd;
+    ret->length = st.st_size;
+    ret->source->length = ret->length;
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+ks_stream* ks_stream_create_from_bytes(ks_bytes* bytes)
+{
+    ks_stream* ret = ks_alloc(HANDLE(bytes)->stream->config, sizeof(ks_stream));
+    ks_stream* stream = HANDLE(bytes)->stream;
+
+    if (!ret)
+    {
+        return 0;
+    }
+
+    ret->config = stream->config;
+    if (bytes->data_direct)
+    {
+        ret->data  = bytes->data_direct;
+        ret->start = 0;
+    }
+    else
+    {
+        ret->source = stream->source;
+        ret->data = stream->data;
+        ret->start = bytes->pos + stream->start;
+    }
+    ret->length = bytes->length;
+    ret->parent = stream;
+
+    return ret;
+}
+
+ks_stream* ks_stream_create_from_memory(uint8_t* data, uint64_t len, ks_config* config)
+{
+    ks_stream* ret = ks_alloc(config, sizeof(ks_stream));
+
+    if (!ret)
+    {
+        return 0;
+    }
+
+    ret->config = config;
+    ret->data = data;
+    ret->length = len;
+
+    return ret;
+}
+
+#ifdef KS_HAVE_POSIX
+typedef struct ks_mapping
+{
+    void* addr;
+    size_t length;
+} ks_mapping;
+
+static void mapping_unmap(void* data)
+{
+    ks_mapping* mapping = data;
+    munmap(mapping->addr, mapping->length);
+}
+#endif
+
+ks_stream* ks_stream_create_from_path(const char* path, ks_config* config, ks_access_hint hint)
+{
+#ifdef KS_HAVE_POSIX
+    static uint8_t empty[1];
+    ks_stream* ret;
+    ks_mapping* mapping;
+    struct stat st;
+    int advice;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    ret = ks_alloc(config, sizeof(ks_stream));
+    mapping = ks_alloc(config, sizeof(ks_mapping));
+    if (!ret || !mapping || fstat(fd, &st) != 0 || (uint64_t)st.st_size > (size_t)-1)
+    {
+        close(fd);
+        return 0;
+    }
+
+    ret->config = config;
+    ret->length = st.st_size;
+    ret->data = empty;
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return ret;
+    }
+
+    mapping->length = st.st_size;
+    mapping->addr = mmap(0, mapping->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping->addr == MAP_FAILED)
+    {
+        KS_ERROR(config, "Failed to map file", KS_ERROR_READ_FAILED);
+        return 0;
+    }
+    if (!config_add_cleanup(config, mapping_unmap, mapping))
+    {
+        mapping_unmap(mapping);
+        return 0;
+    }
+
+    switch (hint)
+    {
+        case KS_ACCESS_SEQUENTIAL:
+            advice = POSIX_MADV_SEQUENTIAL;
+            break;
+        case KS_ACCESS_RANDOM:
+            advice = POSIX_MADV_RANDOM;
+            break;
+        case KS_ACCESS_WILLNEED:
+            advice = POSIX_MADV_WILLNEED;
+            break;
+        default:
+            advice = POSIX_MADV_NORMAL;
+            break;
+    }
+    posix_madvise(mapping->addr, mapping->length, advice);
+
+    ret->data = mapping->addr;
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+typedef struct ks_feed
+{
+    ks_stream stream;
+    ks_stream_source source;
+} ks_feed;
+
+static void feed_free(void* data)
+{
+    ks_feed* feed = data;
+    ks_scratch_free(feed->stream.config, feed->source.window);
+    ks_scratch_free(feed->stream.config, feed);
+}
+
+ks_stream* ks_stream_create_incremental(ks_config* config)
+{
+    ks_feed* feed = ks_scratch_alloc(config, sizeof(ks_feed));
+
+    if (!feed)
+    {
+        return 0;
+    }
+    memset(feed, 0, sizeof(ks_feed));
+    if (!config_add_cleanup_persistent(config, feed_free, feed))
+    {
+        ks_scratch_free(config, feed);
+        return 0;
+    }
+
+    feed->stream.config = config;
+    feed->stream.source = &feed->source;
+    feed->stream.length = KS_LENGTH_UNKNOWN;
+    feed->source.type = KS_SOURCE_FEED;
+    return &feed->stream;
+}
+
+void ks_stream_destroy(ks_stream* stream)
+{
+    if (stream && stream->source && stream->source->type == KS_SOURCE_FEED)
+    {
+        /* The stream is the first member of its ks_feed */
+        config_run_cleanup_persistent(stream->config, stream);
+    }
+}
+
+static ks_bool feed_prepare(ks_stream* stream)
+{
+    if (!stream->source || stream->source->type != KS_SOURCE_FEED || stream->source->eof)
+    {
+        KS_ERROR(stream->config, "Stream does not accept data", KS_ERROR_OTHER);
+        return 0;
+    }
+    /* The flag survives ks_config_reset, which clears the error between attempts */
+    if (stream->source->starved)
+    {
+        if (stream->config->error == KS_ERROR_NEED_MORE_DATA)
+        {
+            stream->config->error = KS_ERROR_OKAY;
+        }
+        stream->source->starved = 0;
+        stream->pos = stream->source->mark;
+        stream->bits_left = 0;
+    }
+    return 1;
+}
+
+void ks_stream_feed(ks_stream* stream, const uint8_t* data, uint64_t len)
+{
+    ks_stream_source* source = stream->source;
+
+    if (!feed_prepare(stream))
+    {
+        return;
+    }
+
+    if (source->window_length + len > source->window_size && source->mark > source->window_start)
+    {
+        uint64_t drop = source->mark - source->window_start;
+        memmove(source->window, source->window + drop, source->window_length - drop);
+        source->window_start = source->mark;
+        source->window_length -= drop;
+    }
+    if (source->window_length + len > source->window_size)
+    {
+        uint64_t size = max(source->window_size * 2, source->window_length + len);
+        uint8_t* window = ks_scratch_realloc(stream->config, source->window, max(size, stream->config->file_window_size));
+        if (!window)
+        {
+            KS_ERROR(stream->config, "Failed to grow feed buffer", KS_ERROR_REALLOC_FAILED);
+            return;
+        }
+        source->window = window;
+        source->window_size = max(size, stream->config->file_window_size);
+    }
+
+    memcpy(source->window + source->window_length, data, len);
+    source->window_length += len;
+    source->length += len;
+}
+
+void ks_stream_feed_eof(ks_stream* stream)
+{
+    if (!feed_prepare(stream))
+    {
+        return;
+    }
+    stream->source->eof = 1;
+    stream->length = stream->source->length;
+}
+
+void ks_stream_mark(ks_stream* stream)
+{
+    if (stream->source && stream->source->type == KS_SOURCE_FEED)
+    {
+        stream->source->mark = stream->pos;
+    }
+}
+
+ks_stream* ks_stream_get_root(ks_stream* stream)
+{
+    while (stream->parent)
+    {
+        stream = stream->parent;
+    }
+    return stream;
+}
+
+uint64_t ks_stream_get_pos(ks_stream* stream)
+{
+    return stream->pos;
+}
+
+void ks_stream_seek(ks_stream* stream, uint64_t pos)
+{
+    KS_ASSERT(pos > stream->length, "End of stream", KS_ERROR_END_OF_STREAM, VOID);
+    stream->pos = pos;
+}
+
+#ifdef KS_HAVE_POSIX
+static ks_bool source_pread(const ks_stream* stream, uint64_t offset, uint64_t len, uint8_t* bytes)
+{
+    while (len > 0)
+    {
+        ssize_t read = pread(stream->source->fd, bytes, (size_t)min(len, (uint64_t)1 << 30), offset);
+        if (read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (read <= 0)
+        {
+            KS_ERROR(stream->config, "Failed to read", KS_ERROR_READ_FAILED);
+            return 0;
+        }
+        bytes += read;
+        offset += read;
+        len -= read;
+    }
+    return 1;
+}
+#endif
+
+/* Asks the OS to start loading the range in the background */
+static void source_advise(const ks_stream_source* source, uint64_t offset, uint64_t len)
+{
+#if defined(KS_HAVE_POSIX) && defined(POSIX_FADV_WILLNEED)
+    int fd = source->type == KS_SOURCE_FD ? source->fd : fileno(source->file);
+    posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/* Keeps the advised range ahead of sequential reads, so the disk works while the data before it is decoded */
+static void source_readahead(ks_stream_source* source, uint64_t offset, uint64_t len)
+{
+    uint64_t end = offset + len;
+    ks_bool sequential = offset == source->read_end;
+
+    source->read_end = end;
+    if (!sequential || source->readahead_size == 0)
+    {
+        return;
+    }
+    if (source->readahead_end < end + source->readahead_size / 2)
+    {
+        uint64_t start = max(source->readahead_end, end);
+        uint64_t stop = min(end + source->readahead_size, source->length);
+        if (stop > start)
+        {
+            source_advise(source, start, stop - start);
+            source->readahead_end = stop;
+        }
+    }
+}
+
+static ks_bool source_read_direct(const ks_stream* stream, uint64_t offset, uint64_t len, uint8_t* bytes)
+{
+    ks_stream_source* source = stream->source;
+    int success;
+    size_t read;
+
+    source_readahead(source, offset, len);
+
+#ifdef KS_HAVE_POSIX
+    if (source->type == KS_SOURCE_FD)
+    {
+        return source_pread(stream, offset, len, bytes);
+    }
+#endif
+
+    success = file_seek(source->file, offset, SEEK_SET);
+    read = fread(bytes, 1, len, source->file);
+    if (success != 0)
+    {
+        KS_ERROR(stream->config, "Failed to seek", KS_ERROR_SEEK_FAILED);
+        return 0;
+    }
+    if (len != read)
+    {
+        KS_ERROR(stream->config, "Failed to read", KS_ERROR_READ_FAILED);
+        return 0;
+    }
+    return 1;
+}
+
+void ks_stream_prefetch(ks_stream* stream, uint64_t pos, uint64_t len)
+{
+    if (pos >= stream->length)
+    {
+        return;
+    }
+    len = min(len, stream->length - pos);
+
+    if (stream->source)
+    {
+        if (stream->source->type == KS_SOURCE_FILE || stream->source->type == KS_SOURCE_FD)
+        {
+            source_advise(stream->source, stream->start + pos, len);
+        }
+        return;
+    }
+#ifdef KS_HAVE_POSIX
+    {
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t begin = (uintptr_t)(stream->data + stream->start + pos);
+        uintptr_t aligned = begin - begin % page;
+        posix_madvise((void*)aligned, len + (begin - aligned), POSIX_MADV_WILLNEED);
+    }
+#endif
+}
+
+/* Loads the aligned window containing offset */
+static ks_bool source_fill(const ks_stream* stream, uint64_t offset)
+{
+    ks_stream_source* source = stream->source;
+    uint64_t start = offset - offset % source->window_size;
+    uint64_t len = min(source->window_size, source->length - start);
+
+    source->window_length = 0;
+    if (!source_read_direct(stream, start, len, source->window))
+    {
+        return 0;
+    }
+    source->window_start = start;
+    source->window_length = len;
+    return 1;
+}
+
+static ks_bool source_is_sequential(const ks_stream_source* source)
+{
+    return source->type == KS_SOURCE_FEED || source->type == KS_SOURCE_PIPE || source->type == KS_SOURCE_ZLIB;
+}
+
+/* Decompresses into the free space of the window, returns the number of bytes produced */
+static size_t zlib_read(const ks_stream* stream, uint8_t* out, size_t len)
+{
+    ks_stream_source* source = stream->source;
+    ks_config* config = stream->config;
+    const uint8_t* in = source->input + source->input_pos;
+    const uint8_t* in_start = in;
+    uint64_t in_len = source->input_length - source->input_pos;
+    uint64_t out_len = len;
+    ks_bool done = 0;
+
+    if (config->inflater.step(source->inflate_state, &in, &in_len, &out, &out_len, &done) != KS_ERROR_OKAY)
+    {
+        KS_ERROR(config, "Failed to inflate", KS_ERROR_ZLIB);
+        return 0;
+    }
+    source->input_pos += in - in_start;
+    if (done)
+    {
+        source->eof = 1;
+    }
+    else if (out_len > 0 && (in_len == 0 || in == in_start))
+    {
+        KS_ERROR(config, "Compressed data is truncated", KS_ERROR_ZLIB);
+    }
+    return len - out_len;
+}
+
+/* The inflater cannot seek, so going back starts decompressing over from the beginning */
+static ks_bool zlib_restart(const ks_stream* stream)
+{
+    ks_stream_source* source = stream->source;
+
+    if (stream->config->inflater.reset(source->inflate_state) != KS_ERROR_OKAY)
+    {
+        KS_ERROR(stream->config, "Failed to inflate", KS_ERROR_ZLIB);
+        return 0;
+    }
+    source->input_pos = 0;
+    source->length = 0;
+    source->window_start = 0;
+    source->window_length = 0;
+    source->eof = 0;
+    return 1;
+}
+
+static void feed_need_more_data(const ks_stream* stream)
+{
+    stream->source->starved = 1;
+    KS_ERROR(stream->config, "Need more data", KS_ERROR_NEED_MORE_DATA);
+}
+
+/* Buffers pipe or zlib data up to offset, releasing what lies before both offset and keep */
+static ks_bool sequential_read(const ks_stream* stream, uint64_t offset, uint64_t keep)
+{
+    ks_stream_source* source = stream->source;
+
+    while (!source->eof && offset >= source->window_start + source->window_length)
+    {
+        size_t len;
+        size_t read;
+
+        if (keep > source->window_start)
+        {
+            uint64_t drop = min(keep - source->window_start, source->window_length);
+            memmove(source->window, source->window + drop, source->window_length - drop);
+            source->window_start += drop;
+            source->window_length -= drop;
+        }
+        if (source->window_length == source->window_size)
+        {
+            uint8_t* window = ks_realloc(stream->config, source->window, source->window_size * 2);
+            if (!window)
+            {
+                return 0;
+            }
+            source->window = window;
+            source->window_size *= 2;
+        }
+
+        len = source->window_size - source->window_length;
+        if (source->type == KS_SOURCE_ZLIB)
+        {
+            read = zlib_read(stream, source->window + source->window_length, len);
+            source->window_length += read;
+            source->length += read;
+            if (stream->config->error)
+            {
+                return 0;
+            }
+            continue;
+        }
+        read = fread(source->window + source->window_length, 1, len, source->file);
+        source->window_length += read;
+        source->length += read;
+        if (read != len)
+        {
+            if (ferror(source->file))
+            {
+                KS_ERROR(stream->config, "Failed to read", KS_ERROR_READ_FAILED);
+                return 0;
+            }
+            source->eof = 1;
+        }
+    }
+    return 1;
+}
+
+/* Returns the window bytes starting at offset, *len is reduced to what the window holds */
+static const uint8_t* source_chunk(const ks_stream* stream, uint64_t offset, uint64_t* len)
+{
+    ks_stream_source* source = stream->source;
+
+    if (source->type == KS_SOURCE_ZLIB && offset < source->window_start && !zlib_restart(stream))
+    {
+        return 0;
+    }
+    if ((source->type == KS_SOURCE_PIPE || source->type == KS_SOURCE_ZLIB)
+        && !sequential_read(stream, offset, min(offset, stream->start + stream->pos)))
+    {
+        return 0;
+    }
+    if (source_is_sequential(source))
+    {
+        if (offset < source->window_start)
+        {
+            KS_ERROR(stream->config, "Data was already released", KS_ERROR_SEEK_FAILED);
+            return 0;
+        }
+        if (offset >= source->window_start + source->window_length)
+        {
+            if (source->eof)
+            {
+                KS_ERROR(stream->config, "End of stream", KS_ERROR_END_OF_STREAM);
+            }
+            else
+            {
+                feed_need_more_data(stream);
+            }
+            return 0;
+        }
+    }
+    else if (offset < source->window_start || offset >= source->window_start + source->window_length)
+    {
+        if (!source_fill(stream, offset))
+        {
+            return 0;
+        }
+    }
+    *len = min(*len, source->window_start + source->window_length - offset);
+    return source->window + (offset - source->window_start);
+}
+
+static void source_read(const ks_stream* stream, uint64_t offset, uint64_t len, uint8_t* bytes)
 {
-    ks_stream* ret;
+    ks_stream_source* source = stream->source;
 
-    if (!file)
+    /* Reads that would replace the whole window bypass it */
+    if (len >= source->window_size && !source_is_sequential(source))
     {
-        return 0;
+        source_read_direct(stream, offset, len, bytes);
+        return;
     }
 
-    ret = ks_alloc(config, sizeof(ks_stream));
-    ret->config = config;
-    ret->is_file = 1;
-    ret->file = file;
-
-    fseek(file, 0, SEEK_END);
-    ret->length = ftell(file);
-    return ret;
+    while (len > 0)
+    {
+        uint64_t count = len;
+        const uint8_t* chunk = source_chunk(stream, offset, &count);
+        if (!chunk)
+        {
+            return;
+        }
+        memcpy(bytes, chunk, count);
+        bytes += count;
+        offset += count;
+        len -= count;
+    }
 }
 
-ks_stream* ks_stream_create_from_bytes(ks_bytes* bytes)
+static void stream_read_bytes_nomove(const ks_stream* stream, uint64_t pos, uint64_t len, uint8_t* bytes)
 {
-    ks_stream* ret = ks_alloc(HANDLE(bytes)->stream->config, sizeof(ks_stream));
-    ks_stream* stream = HANDLE(bytes)->stream;
-
-    ret->config = stream->config;
-    ret->is_file = stream->is_file;
-    if (bytes->data_direct)
+    if (pos + len > stream->length)
     {
-        ret->data  = bytes->data_direct;
-        ret->is_file = 0;
-        ret->start = 0;
+        KS_ERROR(stream->config, "End of stream", KS_ERROR_END_OF_STREAM);
+        return;
+    }
+    if (stream->source)
+    {
+        source_read(stream, stream->start + pos, len, bytes);
     }
     else
     {
-        ret->file = stream->file;
-        ret->data = stream->data;
-        ret->start = bytes->pos + stream->start;
+        memcpy(bytes, stream->data + stream->start + pos, len);
     }
-    ret->length = bytes->length;
-    ret->parent = stream;
-
-    return ret;
 }
 
-ks_stream* ks_stream_create_from_memory(uint8_t* data, int len, ks_config* config)
+/* The end of pipe and zlib data is only found by reading, the length is set once pos reaches it */
+static ks_bool stream_reach(ks_stream* stream, uint64_t pos)
 {
-    ks_stream* ret = ks_alloc(config, sizeof(ks_stream));
+    ks_stream_source* source = stream->source;
+    uint64_t offset = stream->start + pos;
 
-    ret->config = config;
-    ret->is_file = 0;
-    ret->data = data;
-    ret->length = len;
-
-    return ret;
+    if (stream->length != KS_LENGTH_UNKNOWN || source->type == KS_SOURCE_FEED || offset < source->length)
+    {
+        return 1;
+    }
+    if (!sequential_read(stream, offset, min(offset, stream->start + stream->pos)))
+    {
+        return 0;
+    }
+    if (source->eof && offset >= source->length)
+    {
+        stream->length = source->length - stream->start;
+    }
+    return 1;
 }
 
-ks_stream* ks_stream_get_root(ks_stream* stream)
+/* Returns the stream bytes starting at pos without copying, *len is reduced to what is available at once. At the
+   end of the stream it returns 0 without an error */
+static const uint8_t* stream_chunk(ks_stream* stream, uint64_t pos, uint64_t* len)
 {
-    while (stream->parent)
+    if (stream->source && !stream_reach(stream, pos))
     {
-        stream = stream->parent;
+        return 0;
     }
-    return stream;
+    if (pos >= stream->length)
+    {
+        *len = 0;
+        return 0;
+    }
+    *len = min(*len, stream->length - pos);
+    if (stream->source)
+    {
+        return source_chunk(stream, stream->start + pos, len);
+    }
+    return stream->data + stream->start + pos;
 }
 
-ks_bool ks_stream_is_eof(ks_stream* stream)
+static void stream_read_bytes(ks_stream* stream, uint64_t len, void* bytes)
 {
-    return stream->pos == stream->length && stream->bits_left == 0;
+    KS_CHECK(stream_read_bytes_nomove(stream, stream->pos, len, bytes), VOID);
+    stream->pos += len;
 }
 
-uint64_t ks_stream_get_pos(ks_stream* stream)
+/* Data of sequential sources is released after use, so bytes read from them are copied out */
+static void bytes_materialize(ks_stream* stream, ks_bytes* bytes)
 {
-    return stream->pos;
-}
+    uint8_t* data;
 
-uint64_t ks_stream_get_length(ks_stream* stream)
-{
-    return stream->length;
+    if (!stream->source || !source_is_sequential(stream->source) || stream->config->error)
+    {
+        return;
+    }
+    data = ks_alloc(stream->config, bytes->length);
+    if (!data)
+    {
+        return;
+    }
+    stream_read_bytes_nomove(stream, bytes->pos, bytes->length, data);
+    bytes->data_direct = data;
 }
 
-void ks_stream_seek(ks_stream* stream, uint64_t pos)
+/* Pipes and zlib streams are read up to their end, incremental streams fail with KS_ERROR_NEED_MORE_DATA until it
+   was fed */
+static ks_bool stream_check_length(ks_stream* stream)
 {
-    KS_ASSERT(pos > stream->length, "End of stream", KS_ERROR_END_OF_STREAM, VOID);
-    stream->pos = pos;
-}
+    ks_stream_source* source = stream->source;
 
-static void stream_read_bytes_nomove(const ks_stream* stream, uint64_t pos, uint64_t len, uint8_t* bytes)
-{
-    KS_ASSERT(pos + len > stream->length, "End of stream", KS_ERROR_END_OF_STREAM, VOID);
-    if (stream->is_file)
+    if (stream->length != KS_LENGTH_UNKNOWN)
     {
-        int success = fseek(stream->file, stream->start + pos, SEEK_SET);
-        size_t read = fread(bytes, 1, len, stream->file);
-        KS_ASSERT(success != 0, "Failed to seek", KS_ERROR_SEEK_FAILED, VOID);
-        KS_ASSERT(len != read, "Failed to read", KS_ERROR_READ_FAILED, VOID);
+        return 1;
     }
-    else
+    if (source->type == KS_SOURCE_PIPE || source->type == KS_SOURCE_ZLIB)
     {
-        memcpy(bytes, stream->data + stream->start + pos, len);
+        while (!source->eof)
+        {
+            /* Zlib data can be decompressed again, so it is not kept while only counting */
+            uint64_t keep = source->type == KS_SOURCE_ZLIB ? source->length : min(source->length, stream->start + stream->pos);
+            if (!sequential_read(stream, source->length, keep))
+            {
+                return 0;
+            }
+        }
+        stream->length = source->length;
+        return 1;
     }
+    feed_need_more_data(stream);
+    return 0;
 }
 
-static void stream_read_bytes(ks_stream* stream, uint64_t len, void* bytes)
+uint64_t ks_stream_get_length(ks_stream* stream)
 {
-    KS_CHECK(stream_read_bytes_nomove(stream, stream->pos, len, bytes), VOID);
-    stream->pos += len;
+    if (!stream_check_length(stream))
+    {
+        return 0;
+    }
+    return stream->length;
 }
 
-static int64_t stream_read_int(ks_stream* stream, int len, ks_bool big_endian)
+ks_bool ks_stream_is_eof(ks_stream* stream)
 {
-    uint8_t bytes[8];
-    int64_t ret = 0;
-    int i;
-
-    KS_CHECK(stream_read_bytes(stream, len, bytes), 0);
-
-    if (big_endian)
+    if (stream->length == KS_LENGTH_UNKNOWN && stream->pos >= stream->source->length)
     {
-        reverse_uint8_t(bytes, len);
+        if (stream->source->type == KS_SOURCE_FEED)
+        {
+            feed_need_more_data(stream);
+            return 0;
+        }
+        if (!stream_reach(stream, stream->pos))
+        {
+            return 0;
+        }
     }
+    return stream->pos == stream->length && stream->bits_left == 0;
+}
 
-    for (i = 0; i < len; i++)
+static uint64_t bytes_to_uint(const uint8_t* bytes, int len, ks_bool big_endian)
+{
+    uint16_t value16;
+    uint32_t value32;
+    uint64_t value64;
+
+    switch (len)
     {
-        ret += (int64_t)bytes[i] << (i*8);
+        case 1:
+            return bytes[0];
+        case 2:
+            memcpy(&value16, bytes, sizeof(value16));
+            return big_endian != KS_HOST_BIG_ENDIAN ? KS_BSWAP16(value16) : value16;
+        case 4:
+            memcpy(&value32, bytes, sizeof(value32));
+            return big_endian != KS_HOST_BIG_ENDIAN ? KS_BSWAP32(value32) : value32;
+        default:
+            memcpy(&value64, bytes, sizeof(value64));
+            return big_endian != KS_HOST_BIG_ENDIAN ? KS_BSWAP64(value64) : value64;
     }
-    return ret;
 }
 
-static ks_bool is_big_endian(void)
+static int64_t stream_read_int(ks_stream* stream, int len, ks_bool big_endian)
 {
-    int n = 1;
-    return *(char *)&n == 0;
+    uint8_t bytes[8];
+
+    if (stream->data && stream->pos + len <= stream->length)
+    {
+        uint64_t ret = bytes_to_uint(stream->data + stream->start + stream->pos, len, big_endian);
+        stream->pos += len;
+        return ret;
+    }
+
+    KS_CHECK(stream_read_bytes(stream, len, bytes), 0);
+    return bytes_to_uint(bytes, len, big_endian);
 }
 
 static float stream_read_float(ks_stream* stream, ks_bool big_endian)
 {
     float value;
-    uint8_t bytes[sizeof(value)];
-
-    KS_CHECK(stream_read_bytes(stream, sizeof(bytes), bytes), 0);
-
-    if (big_endian != is_big_endian())
-    {
-        reverse_uint8_t(bytes, sizeof(bytes));
-    }
+    uint32_t raw;
 
-    memcpy(&value, bytes, sizeof(bytes));
+    KS_CHECK(raw = stream_read_int(stream, sizeof(raw), big_endian), 0);
+    memcpy(&value, &raw, sizeof(value));
     return value;
 }
 
 static double stream_read_double(ks_stream* stream, ks_bool big_endian)
 {
     double value;
-    uint8_t bytes[sizeof(value)];
-
-    KS_CHECK(stream_read_bytes(stream, sizeof(bytes), bytes), 0);
-
-    if (big_endian != is_big_endian())
-    {
-        reverse_uint8_t(bytes, sizeof(bytes));
-    }
+    uint64_t raw;
 
-    memcpy(&value, bytes, sizeof(bytes));
+    KS_CHECK(raw = stream_read_int(stream, sizeof(raw), big_endian), 0);
+    memcpy(&value, &raw, sizeof(value));
     return value;
 }
 
@@ -426,129 +1692,556 @@ double ks_stream_read_f8be(ks_stream* stream)
     return temp;
 }
 
-uint64_t ks_stream_read_bits_be(ks_stream* stream, int width)
+/* Reads the bytes a bit field needs as an unsigned integer, memory streams are served with a single word load */
+static uint64_t stream_read_bits_bytes(ks_stream* stream, int bytes_needed, ks_bool big_endian)
+{
+    uint8_t buf[8];
+    uint64_t res = 0;
+    int i;
+
+    if (stream->data && stream->pos + 8 <= stream->length)
+    {
+        uint64_t word = bytes_to_uint(stream->data + stream->start + stream->pos, 8, big_endian);
+        stream->pos += bytes_needed;
+        if (bytes_needed == 8)
+        {
+            return word;
+        }
+        return big_endian ? word >> (64 - bytes_needed * 8) : word & ((((uint64_t)1) << (bytes_needed * 8)) - 1);
+    }
+
+    KS_CHECK(stream_read_bytes(stream, bytes_needed, buf), 0);
+    for (i = 0; i < bytes_needed; i++)
+    {
+        res |= (uint64_t)buf[i] << (big_endian ? (bytes_needed - 1 - i) * 8 : i * 8);
+    }
+    return res;
+}
+
+uint64_t ks_stream_read_bits_be(ks_stream* stream, int width)
+{
+    uint64_t res = 0;
+    uint64_t mask;
+
+    int bits_needed = width - stream->bits_left;
+    stream->bits_left = -bits_needed & 7; /* -bits_needed mod 8 */
+
+    if (bits_needed > 0)
+    {
+        uint64_t new_bits;
+        int bytes_needed = ((bits_needed - 1) / 8) + 1;
+        if (bytes_needed > 8)
+        {
+            KS_ERROR(stream->config, "More than 8 bytes requested", KS_ERROR_BIT_VAR_TOO_BIG);
+            return 0;
+        }
+        KS_CHECK(res = stream_read_bits_bytes(stream, bytes_needed, 1), 0);
+
+        new_bits = res;
+        res = res >> stream->bits_left | (bits_needed < 64 ? stream->bits << bits_needed : 0); /* avoid undefined behavior of x << 64 */
+        stream->bits = new_bits; /* will be masked at the end of the function */
+    }
+    else
+    {
+        res = stream->bits >> -bits_needed; /* shift unneeded bits out */
+    }
+
+    mask = (((uint64_t)1) << stream->bits_left) - 1;
+    stream->bits &= mask;
+
+    return res;
+}
+
+uint64_t ks_stream_read_bits_le(ks_stream* stream, int width)
+{
+    uint64_t res = 0;
+    int bits_needed = width - stream->bits_left;
+
+    if (bits_needed > 0)
+    {
+        uint64_t new_bits;
+        int bytes_needed = ((bits_needed - 1) / 8) + 1;
+        if (bytes_needed > 8)
+        {
+            KS_ERROR(stream->config, "More than 8 bytes requested", KS_ERROR_BIT_VAR_TOO_BIG);
+            return 0;
+        }
+        KS_CHECK(res = stream_read_bits_bytes(stream, bytes_needed, 0), 0);
+
+        new_bits = bits_needed < 64 ? res >> bits_needed : 0; /* avoid undefined behavior of x >> 64 */
+        res = res << stream->bits_left | stream->bits;
+        stream->bits = new_bits;
+    }
+    else
+    {
+        res = stream->bits;
+        stream->bits >>= width;
+    }
+
+    stream->bits_left = -bits_needed & 7; /* `-bits_needed mod 8 */
+
+    if (width < 64)
+    {
+        uint64_t mask = (((uint64_t)1) << width) - 1;
+        res &= mask;
+    }
+    return res;
+}
+
+/* Memory streams are decoded with one word load and a shift per field, the stream state is only written back at
+   the end. Fields the word load cannot serve go through the single field readers. */
+static void stream_read_bits_array(ks_stream* stream, const int* widths, uint64_t count, uint64_t* values, ks_bool big_endian)
+{
+    uint64_t i = 0;
+
+    while (i < count)
+    {
+        if (!stream->source)
+        {
+            const uint8_t* data = stream->data + stream->start;
+            uint64_t bit = stream->pos * 8 - stream->bits_left;
+            int left;
+
+            for (; i < count && widths[i] > 0 && widths[i] <= 56 && bit / 8 + 8 <= stream->length; i++)
+            {
+                uint64_t word = bytes_to_uint(data + bit / 8, 8, big_endian);
+                if (big_endian)
+                {
+                    values[i] = (word << (bit % 8)) >> (64 - widths[i]);
+                }
+                else
+                {
+                    values[i] = (word >> (bit % 8)) & ((((uint64_t)1) << widths[i]) - 1);
+                }
+                bit += widths[i];
+            }
+
+            stream->pos = (bit + 7) / 8;
+            left = stream->pos * 8 - bit;
+            stream->bits_left = left;
+            stream->bits = 0;
+            if (left > 0)
+            {
+                uint8_t last = data[stream->pos - 1];
+                stream->bits = big_endian ? last & ((1 << left) - 1) : last >> (8 - left);
+            }
+        }
+
+        if (i < count)
+        {
+            KS_CHECK_VOID(values[i] = big_endian ? ks_stream_read_bits_be(stream, widths[i]) : ks_stream_read_bits_le(stream, widths[i]));
+            i++;
+        }
+    }
+}
+
+void ks_stream_read_bits_be_array(ks_stream* stream, const int* widths, uint64_t count, uint64_t* values)
+{
+    stream_read_bits_array(stream, widths, count, values, 1);
+}
+
+void ks_stream_read_bits_le_array(ks_stream* stream, const int* widths, uint64_t count, uint64_t* values)
+{
+    stream_read_bits_array(stream, widths, count, values, 0);
+}
+
+static void swap_array_scalar(uint8_t* data, uint64_t count, int size)
+{
+    uint64_t i;
+    for (i = 0; i < count; i++)
+    {
+        uint8_t* element = data + i * size;
+        uint16_t value16;
+        uint32_t value32;
+        uint64_t value64;
+        switch (size)
+        {
+            case 2:
+                memcpy(&value16, element, sizeof(value16));
+                value16 = KS_BSWAP16(value16);
+                memcpy(element, &value16, sizeof(value16));
+                break;
+            case 4:
+                memcpy(&value32, element, sizeof(value32));
+                value32 = KS_BSWAP32(value32);
+                memcpy(element, &value32, sizeof(value32));
+                break;
+            default:
+                memcpy(&value64, element, sizeof(value64));
+                value64 = KS_BSWAP64(value64);
+                memcpy(element, &value64, sizeof(value64));
+                break;
+        }
+    }
+}
+
+#ifdef KS_HAVE_X86_DISPATCH
+/* pshufb pattern that reverses each element of the given size within 16 bytes */
+__attribute__((target("ssse3")))
+static __m128i swap_mask(int size)
+{
+    switch (size)
+    {
+        case 2:
+            return _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+        case 4:
+            return _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        default:
+            return _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void swap_array_ssse3(uint8_t* data, uint64_t count, int size)
+{
+    __m128i mask = swap_mask(size);
+    uint64_t i = 0;
+    for (; (i + 16 / size) <= count; i += 16 / size)
+    {
+        __m128i value = _mm_loadu_si128((__m128i*)(data + i * size));
+        _mm_storeu_si128((__m128i*)(data + i * size), _mm_shuffle_epi8(value, mask));
+    }
+    swap_array_scalar(data + i * size, count - i, size);
+}
+
+__attribute__((target("avx2")))
+static void swap_array_avx2(uint8_t* data, uint64_t count, int size)
+{
+    __m256i mask = _mm256_broadcastsi128_si256(swap_mask(size));
+    uint64_t i = 0;
+    for (; (i + 32 / size) <= count; i += 32 / size)
+    {
+        __m256i value = _mm256_loadu_si256((__m256i*)(data + i * size));
+        _mm256_storeu_si256((__m256i*)(data + i * size), _mm256_shuffle_epi8(value, mask));
+    }
+    swap_array_scalar(data + i * size, count - i, size);
+}
+#endif
+
+static void swap_array(uint8_t* data, uint64_t count, int size)
+{
+#ifdef KS_HAVE_X86_DISPATCH
+    if (__builtin_cpu_supports("avx2"))
+    {
+        swap_array_avx2(data, count, size);
+        return;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        swap_array_ssse3(data, count, size);
+        return;
+    }
+#endif
+    swap_array_scalar(data, count, size);
+}
+
+void ks_stream_read_array(ks_stream* stream, ks_usertype_generic* array, uint64_t count, ks_bool big_endian)
 {
-    int i;
-    uint64_t res = 0;
-    uint64_t mask;
+    ks_handle* handle = array->handle;
+    ks_array_generic header;
+    uint64_t len;
+    uint8_t* data;
 
-    int bits_needed = width - stream->bits_left;
-    stream->bits_left = -bits_needed & 7; /* -bits_needed mod 8 */
+    if ((handle->type != KS_TYPE_ARRAY_UINT && handle->type != KS_TYPE_ARRAY_INT && handle->type != KS_TYPE_ARRAY_FLOAT)
+        || (handle->type_size != 1 && handle->type_size != 2 && handle->type_size != 4 && handle->type_size != 8))
+    {
+        KS_ERROR(stream->config, "Unsupported array element type", KS_ERROR_OTHER);
+        return;
+    }
+    if (count > (stream->length - stream->pos) / handle->type_size)
+    {
+        KS_ERROR(stream->config, "End of stream", KS_ERROR_END_OF_STREAM);
+        return;
+    }
 
-    if (bits_needed > 0)
+    len = count * handle->type_size;
+    data = stream->data + stream->start + stream->pos;
+    if (stream->config->array_aliasing && !stream->source
+        && (handle->type_size == 1 || big_endian == KS_HOST_BIG_ENDIAN)
+        && (uintptr_t)data % handle->type_size == 0)
     {
-        uint64_t new_bits;
-        uint8_t buf[8];
-        int bytes_needed = ((bits_needed - 1) / 8) + 1;
-        KS_ASSERT(bytes_needed > 8, "More than 8 bytes requested", KS_ERROR_BIT_VAR_TOO_BIG, 0);
-        KS_CHECK(stream_read_bytes(stream, bytes_needed, buf), 0);
-        for (i = 0; i < bytes_needed; i++)
+        stream->pos += len;
+    }
+    else
+    {
+        data = ks_alloc(stream->config, len);
+        if (!data)
+        {
+            return;
+        }
+        KS_CHECK_VOID(stream_read_bytes(stream, len, data));
+        if (handle->type_size > 1 && big_endian != KS_HOST_BIG_ENDIAN)
         {
-            res = res << 8 | buf[i];
+            swap_array(data, count, handle->type_size);
         }
+    }
 
-        new_bits = res;
-        res = res >> stream->bits_left | (bits_needed < 64 ? stream->bits << bits_needed : 0); /* avoid undefined behavior of x << 64 */
-        stream->bits = new_bits; /* will be masked at the end of the function */
+    memcpy(&header, array, sizeof(ks_array_generic)); /* Type punning */
+    header.size = count;
+    header.data = data;
+    memcpy(array, &header, sizeof(ks_array_generic));
+}
+
+ks_bytes* ks_stream_read_bytes(ks_stream* stream, uint64_t len)
+{
+    ks_bytes* ret;
+
+    if (len > stream->length - stream->pos)
+    {
+        KS_ERROR(stream->config, "End of stream", KS_ERROR_END_OF_STREAM);
+        return 0;
     }
-    else
+
+    ret = bytes_create(stream);
+    if (!ret)
     {
-        res = stream->bits >> -bits_needed; /* shift unneeded bits out */
+        return 0;
     }
+    ret->length = len;
+    ret->pos = stream->pos;
+    bytes_materialize(stream, ret);
 
-    mask = (((uint64_t)1) << stream->bits_left) - 1;
-    stream->bits &= mask;
+    stream->pos += len;
 
-    return res;
+    return ret;
 }
 
-uint64_t ks_stream_read_bits_le(ks_stream* stream, int width)
+ks_bytes* ks_stream_read_bytes_term(ks_stream* stream, uint8_t terminator, ks_bool include, ks_bool consume, ks_bool eos_error)
 {
-    int i;
-    uint64_t res = 0;
-    int bits_needed = width - stream->bits_left;
+    ks_bytes* ret = bytes_create(stream);
+    uint64_t start = stream->pos;
+    uint64_t pos = start;
+    const uint8_t* found = 0;
 
-    if (bits_needed > 0)
+    if (!ret)
     {
-        uint64_t new_bits;
-        uint8_t buf[8];
-        int bytes_needed = ((bits_needed - 1) / 8) + 1;
-        KS_ASSERT(bytes_needed > 8, "More than 8 bytes requested", KS_ERROR_BIT_VAR_TOO_BIG, 0);
-        KS_CHECK(stream_read_bytes(stream, bytes_needed, buf), 0);
-        for (i = 0; i < bytes_needed; i++) {
-            res |= (uint64_t)(buf[i]) << (i * 8);
-        }
-
-        new_bits = bits_needed < 64 ? res >> bits_needed : 0; /* avoid undefined behavior of x >> 64 */
-        res = res << stream->bits_left | stream->bits;
-        stream->bits = new_bits;
+        return 0;
     }
-    else
+    ret->pos = start;
+
+    /* memchr scans whole chunks, file streams are searched one window at a time */
+    while (pos < stream->length)
     {
-        res = stream->bits;
-        stream->bits >>= width;
+        uint64_t len = stream->length - pos;
+        const uint8_t* chunk;
+        KS_CHECK(chunk = stream_chunk(stream, pos, &len), ret);
+        if (!chunk)
+        {
+            break;
+        }
+        found = memchr(chunk, terminator, len);
+        if (found)
+        {
+            pos += found - chunk;
+            break;
+        }
+        pos += len;
     }
 
-    stream->bits_left = -bits_needed & 7; /* `-bits_needed mod 8 */
-
-    if (width < 64)
+    if (!found)
     {
-        uint64_t mask = (((uint64_t)1) << width) - 1;
-        res &= mask;
+        if (eos_error)
+        {
+            KS_ERROR(stream->config, "End of stream", KS_ERROR_END_OF_STREAM);
+            return ret;
+        }
+        ret->length = pos - start;
+        bytes_materialize(stream, ret);
+        stream->pos = pos;
+        return ret;
     }
-    return res;
+
+    ret->length = pos - start + (include ? 1 : 0);
+    bytes_materialize(stream, ret);
+    stream->pos = pos + (consume ? 1 : 0);
+
+    return ret;
 }
 
-ks_bytes* ks_stream_read_bytes(ks_stream* stream, int len)
+/* Offset of the first occurrence of term at a multiple of align, len if there is none */
+static uint64_t find_term(const uint8_t* data, uint64_t len, const uint8_t* term, uint64_t term_len, uint64_t align)
 {
-    ks_bytes* ret = ks_alloc(stream->config, sizeof(ks_bytes));
+    uint64_t i = 0;
+    uint64_t last;
 
-    KS_ASSERT(stream->pos + len > stream->length, "End of stream", KS_ERROR_END_OF_STREAM, ret);
+    if (len < term_len)
+    {
+        return len;
+    }
+    last = len - term_len;
 
-    HANDLE(ret) = ks_handle_create(stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->length = len;
-    ret->pos = stream->pos;
+    if (align == term_len && (term_len == 2 || term_len == 4))
+    {
+        /* Test eight bytes at once, a lane of word is zero where a unit equals term */
+        uint64_t end = len - len % term_len;
+        uint64_t ones = term_len == 2 ? 0x0001000100010001ULL : 0x0000000100000001ULL;
+        uint64_t highs = ones << (term_len * 8 - 1);
+        uint64_t pattern;
+        uint64_t word;
+
+        if (term_len == 2)
+        {
+            uint16_t unit;
+            memcpy(&unit, term, sizeof(unit));
+            pattern = unit * ones;
+        }
+        else
+        {
+            uint32_t unit;
+            memcpy(&unit, term, sizeof(unit));
+            pattern = unit * ones;
+        }
 
-    stream->pos += len;
+        for (; i + sizeof(word) <= end; i += sizeof(word))
+        {
+            memcpy(&word, data + i, sizeof(word));
+            word ^= pattern;
+            if ((word - ones) & ~word & highs)
+            {
+                break;
+            }
+        }
+        for (; i < end; i += term_len)
+        {
+            if (memcmp(data + i, term, term_len) == 0)
+            {
+                return i;
+            }
+        }
+        return len;
+    }
 
-    return ret;
+    while (i <= last)
+    {
+        const uint8_t* found = memchr(data + i, term[0], last - i + 1);
+        uint64_t offset;
+        if (!found)
+        {
+            break;
+        }
+        offset = found - data;
+        if (offset % align != 0)
+        {
+            i = offset - offset % align + align;
+            continue;
+        }
+        if (memcmp(found, term, term_len) == 0)
+        {
+            return offset;
+        }
+        i = offset + align;
+    }
+    return len;
 }
 
-ks_bytes* ks_stream_read_bytes_term(ks_stream* stream, uint8_t terminator, ks_bool include, ks_bool consume, ks_bool eos_error)
+ks_bytes* ks_stream_read_bytes_term_multi(ks_stream* stream, ks_bytes* terminator, int align, ks_bool include, ks_bool consume, ks_bool eos_error)
 {
-    ks_bytes* ret = ks_alloc(stream->config, sizeof(ks_bytes));
-    uint8_t byte;
+    ks_bytes* ret = bytes_create(stream);
+    uint64_t term_len = terminator->length;
     uint64_t start = stream->pos;
-    uint64_t len;
-    HANDLE(ret) = ks_handle_create(stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    do
+    uint64_t pos = start;
+    ks_bool found = 0;
+    const uint8_t* term;
+    uint8_t unit_buffer[8];
+    uint8_t* unit = unit_buffer;
+
+    if (!ret)
+    {
+        return 0;
+    }
+    ret->pos = start;
+    if (term_len == 0 || align < 1)
     {
-        KS_CHECK(stream_read_bytes(stream, 1, &byte), ret);
-    } while(byte != terminator);
+        KS_ERROR(stream->config, "Empty terminator or invalid alignment", KS_ERROR_OTHER);
+        return ret;
+    }
 
-    len = stream->pos - start;
-    if (!consume)
+    term = ks_bytes_get_view(terminator, &term_len);
+    if (!term)
     {
-        stream->pos--;
+        return ret;
     }
-    if (!include)
+    if (term_len > sizeof(unit_buffer))
     {
-        len--;
+        /* ks_alloc reports the error itself */
+        unit = ks_alloc(stream->config, term_len);
+        if (!unit)
+        {
+            return ret;
+        }
     }
 
-    ret->length = len;
-    ret->pos = start;
+    while (!found && pos + term_len <= stream->length)
+    {
+        uint64_t len = stream->length - pos;
+        const uint8_t* chunk = stream_chunk(stream, pos, &len);
+        if (!chunk)
+        {
+            break;
+        }
+
+        if (len >= term_len)
+        {
+            /* Continues after the last offset the whole terminator fit in the chunk at */
+            uint64_t offset = find_term(chunk, len, term, term_len, align);
+            found = offset < len;
+            pos += found ? offset : ((len - term_len) / align + 1) * align;
+        }
+        else
+        {
+            /* Terminator straddles two windows or runs past the end */
+            if (stream->source && !stream_reach(stream, pos + term_len - 1))
+            {
+                break;
+            }
+            if (pos + term_len > stream->length)
+            {
+                break;
+            }
+            stream_read_bytes_nomove(stream, pos, term_len, unit);
+            found = memcmp(unit, term, term_len) == 0;
+            if (!found)
+            {
+                pos += align;
+            }
+        }
+    }
+    if (stream->config->error)
+    {
+        return ret;
+    }
+
+    if (!found)
+    {
+        if (eos_error)
+        {
+            KS_ERROR(stream->config, "End of stream", KS_ERROR_END_OF_STREAM);
+            return ret;
+        }
+        ret->length = stream->length - start;
+        bytes_materialize(stream, ret);
+        stream->pos = stream->length;
+        return ret;
+    }
+
+    ret->length = pos - start + (include ? term_len : 0);
+    bytes_materialize(stream, ret);
+    stream->pos = pos + (consume ? term_len : 0);
 
     return ret;
 }
 
 ks_bytes* ks_stream_read_bytes_full(ks_stream* stream)
 {
-    ks_bytes* ret = ks_alloc(stream->config, sizeof(ks_bytes));
+    ks_bytes* ret = bytes_create(stream);
 
-    HANDLE(ret) = ks_handle_create(stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
+    if (!ret || !stream_check_length(stream))
+    {
+        return ret;
+    }
     ret->length = stream->length - stream->pos;
     ret->pos = stream->pos;
+    bytes_materialize(stream, ret);
 
     stream->pos = stream->length;
 
@@ -557,13 +2250,14 @@ ks_bytes* ks_stream_read_bytes_full(ks_stream* stream)
 
 ks_bytes* ks_bytes_from_data(ks_config* config, uint64_t count, ...)
 {
-    ks_bytes* ret = ks_alloc(config, sizeof(ks_bytes));
+    ks_bytes* ret = bytes_create_direct(config->fake_stream, count);
     va_list list;
-    int i;
+    uint64_t i;
 
-    HANDLE(ret) = ks_handle_create(config->fake_stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->length = count;
-    ret->data_direct = ks_alloc(config, count);
+    if (!ret)
+    {
+        return 0;
+    }
 
     va_start(list, count);
     for (i = 0; i < count; i++)
@@ -577,10 +2271,10 @@ ks_bytes* ks_bytes_from_data(ks_config* config, uint64_t count, ...)
 
 ks_bytes* ks_bytes_from_data_terminated(ks_config* config, ...)
 {
-    ks_bytes* ret = ks_alloc(config, sizeof(ks_bytes));
+    ks_bytes* ret;
     va_list list;
-    int i;
-    int count = 0;
+    uint64_t i;
+    uint64_t count = 0;
 
     va_start(list, config);
     while (va_arg(list, int) != 0xffff)
@@ -589,9 +2283,11 @@ ks_bytes* ks_bytes_from_data_terminated(ks_config* config, ...)
     }
     va_end(list);
 
-    HANDLE(ret) = ks_handle_create(config->fake_stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->length = count;
-    ret->data_direct = ks_alloc(config, count);
+    ret = bytes_create_direct(config->fake_stream, count);
+    if (!ret)
+    {
+        return 0;
+    }
 
     va_start(list, config);
     for (i = 0; i < count; i++)
@@ -605,20 +2301,22 @@ ks_bytes* ks_bytes_from_data_terminated(ks_config* config, ...)
 
 ks_bytes* ks_bytes_recreate(ks_bytes* original, void* data, uint64_t length)
 {
-    ks_bytes* ret = ks_alloc(HANDLE(original)->stream->config, sizeof(ks_bytes));
-    HANDLE(ret) = ks_handle_create(HANDLE(original)->stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->length = length;
-    ret->data_direct = ks_alloc(HANDLE(original)->stream->config, length);
+    ks_bytes* ret = bytes_create_direct(HANDLE(original)->stream, length);
+    if (!ret)
+    {
+        return 0;
+    }
     memcpy(ret->data_direct, data, length);
     return ret;
 }
 
 ks_bytes* ks_bytes_create(ks_config* config, void* data, uint64_t length)
 {
-    ks_bytes* ret = ks_alloc(config, sizeof(ks_bytes));
-    HANDLE(ret) = ks_handle_create(config->fake_stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->length = length;
-    ret->data_direct = ks_alloc(config, length);
+    ks_bytes* ret = bytes_create_direct(config->fake_stream, length);
+    if (!ret)
+    {
+        return 0;
+    }
     memcpy(ret->data_direct, data, length);
     return ret;
 }
@@ -642,6 +2340,39 @@ ks_error ks_bytes_get_data(const ks_bytes* bytes, void* data)
     return stream->config->error;
 }
 
+const uint8_t* ks_bytes_get_view(ks_bytes* bytes, uint64_t* length)
+{
+    const ks_stream* stream = HANDLE(bytes)->stream;
+    uint8_t* data;
+
+    *length = 0;
+    if (bytes->data_direct)
+    {
+        *length = bytes->length;
+        return bytes->data_direct;
+    }
+    if (!stream->source)
+    {
+        *length = bytes->length;
+        return stream->data + stream->start + bytes->pos;
+    }
+
+    /* Windows are replaced while reading, so file bytes are read into the arena once and kept there */
+    data = ks_alloc(stream->config, bytes->length);
+    if (!data)
+    {
+        return 0;
+    }
+    stream_read_bytes_nomove(stream, bytes->pos, bytes->length, data);
+    if (stream->config->error)
+    {
+        return 0;
+    }
+    bytes->data_direct = data;
+    *length = bytes->length;
+    return data;
+}
+
 int64_t ks_bytes_get_at(const ks_bytes* bytes, uint64_t index)
 {
     const ks_stream *stream = HANDLE(bytes)->stream;
@@ -662,48 +2393,89 @@ int64_t ks_bytes_get_at(const ks_bytes* bytes, uint64_t index)
     }
 }
 
+/* Shares the storage of bytes instead of copying it */
+static ks_bytes* bytes_slice(ks_bytes* bytes, uint64_t offset, uint64_t length)
+{
+    ks_bytes* ret = bytes_create(HANDLE(bytes)->stream);
+
+    if (!ret)
+    {
+        return 0;
+    }
+    if (bytes->data_direct)
+    {
+        ret->data_direct = bytes->data_direct + offset;
+    }
+    else
+    {
+        ret->pos = bytes->pos + offset;
+    }
+    ret->length = length;
+    return ret;
+}
+
 ks_bytes* ks_bytes_strip_right(ks_bytes* bytes, int pad)
 {
-    ks_bytes* ret = ks_alloc(HANDLE(bytes)->stream->config, sizeof(ks_bytes));
-    uint64_t len = bytes->length;
+    uint64_t len;
+    const uint8_t* data = ks_bytes_get_view(bytes, &len);
 
-    HANDLE(ret) = ks_handle_create(HANDLE(bytes)->stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->data_direct = ks_alloc(HANDLE(bytes)->stream->config, len);
-    if (ks_bytes_get_data(bytes, ret->data_direct) != KS_ERROR_OKAY)
+    if (!data)
     {
-        ret->length = 0;
-        return ret;
+        return bytes_slice(bytes, 0, 0);
     }
 
-    while (len > 0 && ret->data_direct[len - 1] == pad)
+    while (len > 0 && data[len - 1] == pad)
         len--;
 
-    ret->length = len;
-    return ret;
+    return bytes_slice(bytes, 0, len);
 }
 
 ks_bytes* ks_bytes_terminate(ks_bytes* bytes, int term, ks_bool include)
 {
-    ks_bytes* ret = ks_alloc(HANDLE(bytes)->stream->config, sizeof(ks_bytes));
-    uint64_t len = 0;
-    uint64_t max_len = bytes->length;
+    uint64_t len;
+    const uint8_t* data = ks_bytes_get_view(bytes, &len);
+    const uint8_t* found;
 
-    HANDLE(ret) = ks_handle_create(HANDLE(bytes)->stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->data_direct = ks_alloc(HANDLE(bytes)->stream->config, max_len);
-    if (ks_bytes_get_data(bytes, ret->data_direct) != KS_ERROR_OKAY)
+    if (!data)
     {
-        ret->length = 0;
-        return ret;
+        return bytes_slice(bytes, 0, 0);
+    }
+
+    found = memchr(data, term, len);
+    if (found)
+    {
+        len = found - data + (include ? 1 : 0);
     }
 
-    while (len < max_len && ret->data_direct[len] != term)
-        len++;
+    return bytes_slice(bytes, 0, len);
+}
 
-    if (include && len < max_len)
-        len++;
+ks_bytes* ks_bytes_terminate_multi(ks_bytes* bytes, ks_bytes* terminator, int align, ks_bool include)
+{
+    uint64_t term_len = terminator->length;
+    uint64_t len;
+    const uint8_t* term;
+    const uint8_t* data;
+    uint64_t found;
 
-    ret->length = len;
-    return ret;
+    if (term_len == 0 || align < 1)
+    {
+        KS_ERROR(HANDLE(bytes)->stream->config, "Empty terminator or invalid alignment", KS_ERROR_OTHER);
+        return bytes_slice(bytes, 0, 0);
+    }
+
+    term = ks_bytes_get_view(terminator, &term_len);
+    data = ks_bytes_get_view(bytes, &len);
+    if (!term || !data)
+    {
+        return bytes_slice(bytes, 0, 0);
+    }
+
+    found = find_term(data, len, term, term_len, align);
+    if (include && found < len)
+        found += term_len;
+
+    return bytes_slice(bytes, 0, found);
 }
 
 static int64_t array_get_int(ks_usertype_generic* array, void* data)
@@ -802,7 +2574,7 @@ static void* array_min_max(ks_usertype_generic* array_in, ks_bool max)
     ks_handle* handle = array_in->handle;
     char* pointer;
     ks_array_generic array;
-    int i;
+    int64_t i;
 
     memcpy(&array, handle->data, sizeof(ks_array_generic)); /* Type punning */
 
@@ -874,23 +2646,23 @@ ks_bytes* ks_array_max_bytes(ks_usertype_generic* array)
 static int64_t bytes_minmax(ks_bytes* bytes, ks_bool max)
 {
     uint8_t minmax;
-    uint8_t* data;
-    int i;
+    const uint8_t* data;
+    uint64_t len;
+    uint64_t i;
 
     if (bytes->length == 0)
     {
         return 0;
     }
 
-    data = malloc(bytes->length);
-    if (ks_bytes_get_data(bytes, data) != KS_ERROR_OKAY)
+    data = ks_bytes_get_view(bytes, &len);
+    if (!data)
     {
-        free(data);
         return 0;
     }
     minmax = data[0];
 
-    for (i = 1; i < bytes->length; i++)
+    for (i = 1; i < len; i++)
     {
         if (max)
         {
@@ -908,7 +2680,6 @@ static int64_t bytes_minmax(ks_bytes* bytes, ks_bool max)
         }
     }
 
-    free(data);
     return minmax;
 }
 
@@ -924,10 +2695,11 @@ int64_t ks_bytes_max(ks_bytes* bytes)
 
 ks_string* ks_string_concat(ks_string* s1, ks_string* s2)
 {
-    ks_string* ret = ks_alloc(HANDLE(s1)->stream->config, sizeof(ks_string));
-    HANDLE(ret) = ks_handle_create(HANDLE(s1)->stream, ret, KS_TYPE_STRING, sizeof(ks_string), 0, 0);
-    ret->len = s1->len + s2->len;
-    ret->data = ks_alloc(HANDLE(s1)->stream->config, ret->len + 1);
+    ks_string* ret = string_create(HANDLE(s1)->stream, s1->len + s2->len);
+    if (!ret)
+    {
+        return 0;
+    }
     memcpy(ret->data, s1->data, s1->len);
     memcpy(ret->data + s1->len, s2->data, s2->len);
 
@@ -936,9 +2708,8 @@ ks_string* ks_string_concat(ks_string* s1, ks_string* s2)
 
 ks_string* ks_string_from_int(ks_config* config, int64_t i, int base)
 {
-    ks_string* ret = ks_alloc(config, sizeof(ks_string));
+    ks_string* ret;
     char buf[50] = {0};
-    HANDLE(ret) = ks_handle_create(config->fake_stream, ret, KS_TYPE_STRING, sizeof(ks_string), 0, 0);
     if (base == 10)
     {
         sprintf(buf, "%lld", (long long int)i);
@@ -948,8 +2719,11 @@ ks_string* ks_string_from_int(ks_config* config, int64_t i, int base)
         sprintf(buf, "%llx", (long long int)i);
     }
     
-    ret->len = strlen(buf);
-    ret->data = ks_alloc(config, ret->len + 1);
+    ret = string_create(config->fake_stream, strlen(buf));
+    if (!ret)
+    {
+        return 0;
+    }
     memcpy(ret->data, buf, ret->len);
 
     return ret;
@@ -976,11 +2750,12 @@ int64_t ks_string_to_int(ks_string* str, int base)
 
 ks_string* ks_string_reverse(ks_string* str)
 {
-    int i;
-    ks_string* ret = ks_alloc(HANDLE(str)->stream->config, sizeof(ks_string));
-    HANDLE(ret) = ks_handle_create(HANDLE(str)->stream, ret, KS_TYPE_STRING, sizeof(ks_string), 0, 0);
-    ret->len = str->len;
-    ret->data = ks_alloc(HANDLE(str)->stream->config, ret->len + 1);
+    int64_t i;
+    ks_string* ret = string_create(HANDLE(str)->stream, str->len);
+    if (!ret)
+    {
+        return 0;
+    }
 
     for (i = 0; i < str->len; i++)
     {
@@ -991,12 +2766,13 @@ ks_string* ks_string_reverse(ks_string* str)
 
 ks_string* ks_string_from_bytes(ks_bytes* bytes, ks_string* encoding)
 {
-    ks_string* tmp = ks_alloc(HANDLE(bytes)->stream->config, sizeof(ks_string));
+    ks_string* tmp = string_create(HANDLE(bytes)->stream, bytes->length);
     ks_string* ret;
 
-    HANDLE(tmp) = ks_handle_create(HANDLE(bytes)->stream, tmp, KS_TYPE_STRING, sizeof(ks_string), 0, 0);
-    tmp->len = bytes->length;
-    tmp->data = ks_alloc(HANDLE(bytes)->stream->config, tmp->len + 1);
+    if (!tmp)
+    {
+        return 0;
+    }
     if(ks_bytes_get_data(bytes, tmp->data) != KS_ERROR_OKAY)
     {
         tmp->len = 0;
@@ -1009,32 +2785,58 @@ ks_string* ks_string_from_bytes(ks_bytes* bytes, ks_string* encoding)
 
 ks_string* ks_string_from_cstr(ks_config* config, const char* data)
 {
-    ks_string* ret = ks_alloc(config, sizeof(ks_string));
-    HANDLE(ret) = ks_handle_create(config->fake_stream, ret, KS_TYPE_STRING, sizeof(ks_string), 0, 0);
-    ret->len = strlen(data);
-    ret->data = ks_alloc(config, ret->len + 1);
+    ks_string* ret = string_create(config->fake_stream, strlen(data));
+    if (!ret)
+    {
+        return 0;
+    }
     memcpy(ret->data, data, ret->len);
 
     return ret;
 }
 
-ks_string* ks_string_substr(ks_string* str, int start, int end)
+ks_string* ks_string_substr(ks_string* str, int64_t start, int64_t end)
 {
-    ks_string* ret = ks_alloc(HANDLE(str)->stream->config, sizeof(ks_string));
-    HANDLE(ret) = ks_handle_create(HANDLE(str)->stream, ret, KS_TYPE_STRING, sizeof(ks_string), 0, 0);
-    ret->len = end - start;
-    ret->data = ks_alloc(HANDLE(str)->stream->config, ret->len + 1);
+    ks_string* ret;
+
+    if (start < 0 || end < start || end > str->len)
+    {
+        KS_ERROR(HANDLE(str)->stream->config, "Substring out of range", KS_ERROR_OTHER);
+        return 0;
+    }
+
+    /* Strings stay null terminated, so only a suffix can share the storage of str */
+    if (end == str->len)
+    {
+        ret = usertype_alloc(HANDLE(str)->stream, sizeof(ks_string), KS_TYPE_STRING, sizeof(ks_string), 0, 0, 0, 0);
+        if (!ret)
+        {
+            return 0;
+        }
+        ret->data = str->data + start;
+        ret->len = end - start;
+        return ret;
+    }
+
+    ret = string_create(HANDLE(str)->stream, end - start);
+    if (!ret)
+    {
+        return 0;
+    }
     memcpy(ret->data, str->data + start, ret->len);
     return ret;
 }
 
 #define ARRAY_FROM_DATA(config, type_array, type_element, type_enum) \
-    type_array* ret = ks_alloc(config, sizeof(type_array)); \
+    void* data; \
+    type_array* ret = usertype_alloc(config->fake_stream, sizeof(type_array), type_enum, sizeof(type_element), 0, 0, sizeof(type_element) * count, &data); \
     va_list list; \
-    int i; \
-    HANDLE(ret)= ks_handle_create(config->fake_stream, ret, type_enum, sizeof(type_element), 0, 0); \
+    uint64_t i; \
+    if (!ret) { \
+        return 0; \
+    } \
     ret->size = count; \
-    ret->data = ks_alloc(config, HANDLE(ret)->type_size * count); \
+    ret->data = data; \
     va_start(list, count); \
     for (i = 0; i < count; i++) {  \
         ret->data[i] = va_arg(list, type_element);  \
@@ -1104,29 +2906,31 @@ ks_array_usertype_generic* ks_array_usertype_generic_from_data(ks_config* config
 
 int ks_string_compare(ks_string* left, ks_string* right)
 {
-    return strcmp(left->data, right->data);
+    int ret = memcmp(left->data, right->data, min(left->len, right->len));
+
+    if (ret == 0 && left->len != right->len)
+    {
+        ret = left->len < right->len ? -1 : 1;
+    }
+    return ret;
 }
 
 int ks_bytes_compare(ks_bytes* left, ks_bytes* right)
 {
     int ret;
-    uint8_t* data_left;
-    uint8_t* data_right;
-    uint64_t len;
-
-    data_left = malloc(left->length);
-    data_right = malloc(right->length);
-
-    if (ks_bytes_get_data(left, data_left) != KS_ERROR_OKAY || ks_bytes_get_data(right, data_right) != KS_ERROR_OKAY)
+    const uint8_t* data_left;
+    const uint8_t* data_right;
+    uint64_t len_left;
+    uint64_t len_right;
+
+    data_left = ks_bytes_get_view(left, &len_left);
+    data_right = ks_bytes_get_view(right, &len_right);
+    if (!data_left || !data_right)
     {
-        free(data_left);
-        free(data_right);
         return 0;
     }
 
-    len = min(left->length, right->length);
-
-    ret = memcmp(data_left, data_right, len);
+    ret = memcmp(data_left, data_right, min(len_left, len_right));
 
     if (ret == 0)
     {
@@ -1140,8 +2944,6 @@ int ks_bytes_compare(ks_bytes* left, ks_bytes* right)
         }
     }
 
-    free(data_left);
-    free(data_right);
     return ret;
 }
 
@@ -1168,14 +2970,221 @@ int64_t ks_div(int64_t a, int64_t b)
     return ret;
 }
 
-ks_bytes* ks_bytes_process_xor_int(ks_bytes* bytes, uint64_t xor_int, int count_xor_bytes)
+static void xor_block_scalar(uint8_t* data, const uint8_t* key, uint64_t len)
+{
+    uint64_t i;
+    for (i = 0; i < len; i++)
+    {
+        data[i] ^= key[i];
+    }
+}
+
+static void rotate_block_scalar(uint8_t* data, uint64_t len, int count)
 {
     uint64_t i;
-    ks_bytes* ret = ks_alloc(HANDLE(bytes)->stream->config, sizeof(ks_bytes));
+    for (i = 0; i < len; i++)
+    {
+        data[i] = (uint8_t)(data[i] << count | data[i] >> (8 - count));
+    }
+}
 
-    HANDLE(ret) = ks_handle_create(HANDLE(bytes)->stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->length = bytes->length;
-    ret->data_direct = ks_alloc(HANDLE(bytes)->stream->config, bytes->length);
+#ifdef KS_HAVE_X86_DISPATCH
+/* Compiled for the given instruction set regardless of the build flags, only called when the CPU supports it */
+
+__attribute__((target("sse2")))
+static void xor_block_sse2(uint8_t* data, const uint8_t* key, uint64_t len)
+{
+    uint64_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i mask = _mm_loadu_si128((const __m128i*)(key + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(value, mask));
+    }
+    xor_block_scalar(data + i, key + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void xor_block_avx2(uint8_t* data, const uint8_t* key, uint64_t len)
+{
+    uint64_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i value = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i mask = _mm256_loadu_si256((const __m256i*)(key + i));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(value, mask));
+    }
+    xor_block_scalar(data + i, key + i, len - i);
+}
+
+__attribute__((target("avx512bw")))
+static void xor_block_avx512(uint8_t* data, const uint8_t* key, uint64_t len)
+{
+    uint64_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m512i value = _mm512_loadu_si512((const void*)(data + i));
+        __m512i mask = _mm512_loadu_si512((const void*)(key + i));
+        _mm512_storeu_si512((void*)(data + i), _mm512_xor_si512(value, mask));
+    }
+    xor_block_scalar(data + i, key + i, len - i);
+}
+
+/* There are no byte shifts, so 16-bit lanes are shifted and the bits crossing into the neighbour byte masked off */
+__attribute__((target("sse2")))
+static void rotate_block_sse2(uint8_t* data, uint64_t len, int count)
+{
+    uint64_t i = 0;
+    __m128i left = _mm_cvtsi32_si128(count);
+    __m128i right = _mm_cvtsi32_si128(8 - count);
+    __m128i mask_left = _mm_set1_epi8((char)(0xff << count));
+    __m128i mask_right = _mm_set1_epi8((char)(0xff >> (8 - count)));
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i*)(data + i));
+        value = _mm_or_si128(_mm_and_si128(_mm_sll_epi16(value, left), mask_left),
+                             _mm_and_si128(_mm_srl_epi16(value, right), mask_right));
+        _mm_storeu_si128((__m128i*)(data + i), value);
+    }
+    rotate_block_scalar(data + i, len - i, count);
+}
+
+__attribute__((target("avx2")))
+static void rotate_block_avx2(uint8_t* data, uint64_t len, int count)
+{
+    uint64_t i = 0;
+    __m128i left = _mm_cvtsi32_si128(count);
+    __m128i right = _mm_cvtsi32_si128(8 - count);
+    __m256i mask_left = _mm256_set1_epi8((char)(0xff << count));
+    __m256i mask_right = _mm256_set1_epi8((char)(0xff >> (8 - count)));
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i value = _mm256_loadu_si256((const __m256i*)(data + i));
+        value = _mm256_or_si256(_mm256_and_si256(_mm256_sll_epi16(value, left), mask_left),
+                                _mm256_and_si256(_mm256_srl_epi16(value, right), mask_right));
+        _mm256_storeu_si256((__m256i*)(data + i), value);
+    }
+    rotate_block_scalar(data + i, len - i, count);
+}
+
+__attribute__((target("avx512bw")))
+static void rotate_block_avx512(uint8_t* data, uint64_t len, int count)
+{
+    uint64_t i = 0;
+    __m128i left = _mm_cvtsi32_si128(count);
+    __m128i right = _mm_cvtsi32_si128(8 - count);
+    __m512i mask_left = _mm512_set1_epi8((char)(0xff << count));
+    __m512i mask_right = _mm512_set1_epi8((char)(0xff >> (8 - count)));
+    for (; i + 64 <= len; i += 64)
+    {
+        __m512i value = _mm512_loadu_si512((const void*)(data + i));
+        value = _mm512_or_si512(_mm512_and_si512(_mm512_sll_epi16(value, left), mask_left),
+                                _mm512_and_si512(_mm512_srl_epi16(value, right), mask_right));
+        _mm512_storeu_si512((void*)(data + i), value);
+    }
+    rotate_block_scalar(data + i, len - i, count);
+}
+#endif
+
+static void xor_block(uint8_t* data, const uint8_t* key, uint64_t len)
+{
+#ifdef KS_HAVE_X86_DISPATCH
+    if (__builtin_cpu_supports("avx512bw"))
+    {
+        xor_block_avx512(data, key, len);
+        return;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        xor_block_avx2(data, key, len);
+        return;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        xor_block_sse2(data, key, len);
+        return;
+    }
+#endif
+    xor_block_scalar(data, key, len);
+}
+
+static void rotate_block(uint8_t* data, uint64_t len, int count)
+{
+#ifdef KS_HAVE_X86_DISPATCH
+    if (__builtin_cpu_supports("avx512bw"))
+    {
+        rotate_block_avx512(data, len, count);
+        return;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        rotate_block_avx2(data, len, count);
+        return;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        rotate_block_sse2(data, len, count);
+        return;
+    }
+#endif
+    rotate_block_scalar(data, len, count);
+}
+
+#define KS_XOR_BLOCK_SIZE 4096
+
+/* Xors data with the key repeated from key_pos on. Short keys are first repeated into a block whose length is a
+   multiple of the vector width, so the kernels never see the key wrap around. Returns the key position after data. */
+static uint64_t xor_repeat(uint8_t* data, uint64_t len, const uint8_t* key, uint64_t key_len, uint64_t key_pos)
+{
+    uint8_t block[KS_XOR_BLOCK_SIZE];
+    uint64_t period = key_len;
+    uint64_t pos = 0;
+    uint64_t i;
+
+    if (key_len == 0)
+    {
+        return 0;
+    }
+    if (key_len < 64)
+    {
+        while (period % 64 != 0)
+        {
+            period += key_len;
+        }
+        period *= KS_XOR_BLOCK_SIZE / period;
+        for (i = 0; i < period; i++)
+        {
+            block[i] = key[(key_pos + i) % key_len];
+        }
+        while (pos < len)
+        {
+            uint64_t count = min(period, len - pos);
+            xor_block(data + pos, block, count);
+            pos += count;
+        }
+        return (key_pos + len) % key_len;
+    }
+
+    while (pos < len)
+    {
+        uint64_t count = min(key_len - key_pos, len - pos);
+        xor_block(data + pos, key + key_pos, count);
+        pos += count;
+        key_pos = (key_pos + count) % key_len;
+    }
+    return key_pos;
+}
+
+ks_bytes* ks_bytes_process_xor_int(ks_bytes* bytes, uint64_t xor_int, int count_xor_bytes)
+{
+    uint8_t key[8];
+    int i;
+    ks_bytes* ret = bytes_create_direct(HANDLE(bytes)->stream, bytes->length);
+
+    if (!ret)
+    {
+        return 0;
+    }
 
     if (ks_bytes_get_data(bytes, ret->data_direct) != KS_ERROR_OKAY)
     {
@@ -1183,52 +3192,46 @@ ks_bytes* ks_bytes_process_xor_int(ks_bytes* bytes, uint64_t xor_int, int count_
         return ret;
     }
 
-    for (i = 0; i < ret->length; i++)
+    /* Multi-byte keys apply their most significant byte first */
+    count_xor_bytes = count_xor_bytes < 1 ? 1 : min(count_xor_bytes, 8);
+    for (i = 0; i < count_xor_bytes; i++)
     {
-        ret->data_direct[i] ^= xor_int;
+        key[i] = (uint8_t)(xor_int >> (8 * (count_xor_bytes - 1 - i)));
     }
+    xor_repeat(ret->data_direct, ret->length, key, count_xor_bytes, 0);
     return ret;
 }
 
 ks_bytes* ks_bytes_process_xor_bytes(ks_bytes* bytes, ks_bytes* xor_bytes)
 {
-    uint64_t i;
-    int xor_pos = 0;
-    ks_bytes* ret = ks_alloc(HANDLE(bytes)->stream->config, sizeof(ks_bytes));
-    uint8_t* xor_data = malloc(xor_bytes->length);
+    ks_bytes* ret = bytes_create_direct(HANDLE(bytes)->stream, bytes->length);
+    const uint8_t* xor_data;
+    uint64_t xor_len;
 
-    HANDLE(ret) = ks_handle_create(HANDLE(bytes)->stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->length = bytes->length;
-    ret->data_direct = ks_alloc(HANDLE(bytes)->stream->config, bytes->length);
+    if (!ret)
+    {
+        return 0;
+    }
 
-    if (ks_bytes_get_data(bytes, ret->data_direct) != KS_ERROR_OKAY || ks_bytes_get_data(xor_bytes, xor_data) != KS_ERROR_OKAY)
+    xor_data = ks_bytes_get_view(xor_bytes, &xor_len);
+    if (!xor_data || ks_bytes_get_data(bytes, ret->data_direct) != KS_ERROR_OKAY)
     {
-        free(xor_data);
         ret->length = 0;
         return ret;
     }
 
-    for (i = 0; i < ret->length; i++)
-    {
-        ret->data_direct[i] ^= xor_data[xor_pos];
-        xor_pos++;
-        if (xor_pos >= xor_bytes->length)
-        {
-            xor_pos = 0;
-        }
-    }
-    free(xor_data);
+    xor_repeat(ret->data_direct, ret->length, xor_data, xor_len, 0);
     return ret;
 }
 
 ks_bytes* ks_bytes_process_rotate_left(ks_bytes* bytes, int count)
 {
-    uint64_t i;
-    ks_bytes* ret = ks_alloc(HANDLE(bytes)->stream->config, sizeof(ks_bytes));
+    ks_bytes* ret = bytes_create_direct(HANDLE(bytes)->stream, bytes->length);
 
-    HANDLE(ret) = ks_handle_create(HANDLE(bytes)->stream, ret, KS_TYPE_BYTES, sizeof(ks_bytes), 0, 0);
-    ret->length = bytes->length;
-    ret->data_direct = ks_alloc(HANDLE(bytes)->stream->config, bytes->length);
+    if (!ret)
+    {
+        return 0;
+    }
 
     if (ks_bytes_get_data(bytes, ret->data_direct) != KS_ERROR_OKAY)
     {
@@ -1236,11 +3239,343 @@ ks_bytes* ks_bytes_process_rotate_left(ks_bytes* bytes, int count)
         return ret;
     }
 
-    for (i = 0; i < ret->length; i++)
+    count &= 7;
+    if (count != 0)
+    {
+        rotate_block(ret->data_direct, ret->length, count);
+    }
+    return ret;
+}
+
+ks_bytes* ks_bytes_process_zlib(ks_bytes* bytes, uint64_t size_hint)
+{
+    ks_config* config = HANDLE(bytes)->stream->config;
+    const uint8_t* in;
+    uint64_t in_len;
+    uint8_t* out;
+    uint64_t out_size;
+    uint64_t out_len = 0;
+    ks_bool done = 0;
+    ks_bytes* ret;
+    void* state;
+
+    in = ks_bytes_get_view(bytes, &in_len);
+    if (!in)
+    {
+        return 0;
+    }
+    out_size = size_hint > 0 ? size_hint : max(in_len * 4, 4096);
+    out = ks_alloc(config, out_size);
+    ret = bytes_create(HANDLE(bytes)->stream);
+    if (!out || !ret)
+    {
+        return 0;
+    }
+    state = config_inflate_begin(config);
+    if (!state)
+    {
+        return 0;
+    }
+
+    while (!done)
+    {
+        const uint8_t* in_start = in;
+        uint8_t* next = out + out_len;
+        uint64_t left = out_size - out_len;
+
+        if (left == 0)
+        {
+            uint8_t* out_new = ks_realloc(config, out, out_size * 2);
+            if (!out_new)
+            {
+                break;
+            }
+            out = out_new;
+            out_size *= 2;
+            continue;
+        }
+        if (config->inflater.step(state, &in, &in_len, &next, &left, &done) != KS_ERROR_OKAY)
+        {
+            KS_ERROR(config, "Failed to inflate", KS_ERROR_ZLIB);
+            break;
+        }
+        out_len = next - out;
+        if (!done && left > 0 && (in_len == 0 || in == in_start))
+        {
+            KS_ERROR(config, "Compressed data is truncated", KS_ERROR_ZLIB);
+            break;
+        }
+    }
+    config_inflate_end(config, state);
+    if (!done)
+    {
+        return 0;
+    }
+
+    ret->data_direct = out;
+    ret->length = out_len;
+    return ret;
+}
+
+#define KS_PROCESS_BLOCK_SIZE (64 * 1024)
+
+typedef struct ks_pipeline_stage
+{
+    const uint8_t* key;
+    uint64_t key_len;
+    uint64_t key_pos;
+    uint8_t key_int[8];
+    void* inflate_state;
+    ks_bool inflate_done;
+    uint8_t* buffer; /* Inflate output, custom decoder input */
+    uint64_t buffer_len;
+    uint64_t buffer_size;
+} ks_pipeline_stage;
+
+typedef struct ks_pipeline
+{
+    ks_config* config;
+    const ks_process_step* steps;
+    ks_pipeline_stage* stages;
+    int count;
+    uint8_t* block;
+    uint64_t block_size;
+    uint8_t* out;
+    uint64_t out_len;
+    uint64_t out_size;
+} ks_pipeline;
+
+static ks_bool pipeline_append(ks_pipeline* pipe, uint8_t** buffer, uint64_t* len, uint64_t* size, const uint8_t* data, uint64_t count)
+{
+    if (*len + count > *size)
+    {
+        uint64_t size_new = max(*len + count, *size * 2);
+        uint8_t* buffer_new = ks_realloc(pipe->config, *buffer, size_new);
+        if (!buffer_new)
+        {
+            return 0;
+        }
+        *buffer = buffer_new;
+        *size = size_new;
+    }
+    memcpy(*buffer + *len, data, count);
+    *len += count;
+    return 1;
+}
+
+/* Runs data through the steps from step on, data is modified in place */
+static ks_bool pipeline_push(ks_pipeline* pipe, int step, uint8_t* data, uint64_t len)
+{
+    for (; step < pipe->count; step++)
+    {
+        ks_pipeline_stage* stage = &pipe->stages[step];
+        switch (pipe->steps[step].type)
+        {
+            case KS_PROCESS_XOR_INT:
+            case KS_PROCESS_XOR_BYTES:
+                stage->key_pos = xor_repeat(data, len, stage->key, stage->key_len, stage->key_pos);
+                break;
+            case KS_PROCESS_ROTATE_LEFT:
+                if ((pipe->steps[step].count & 7) != 0)
+                {
+                    rotate_block(data, len, pipe->steps[step].count & 7);
+                }
+                break;
+            case KS_PROCESS_ZLIB:
+            {
+                const uint8_t* in = data;
+                while (!stage->inflate_done)
+                {
+                    const uint8_t* in_start = in;
+                    uint8_t* out = stage->buffer;
+                    uint64_t out_len = stage->buffer_size;
+                    uint64_t in_len = len - (in - data);
+                    if (pipe->config->inflater.step(stage->inflate_state, &in, &in_len, &out, &out_len, &stage->inflate_done) != KS_ERROR_OKAY)
+                    {
+                        KS_ERROR(pipe->config, "Failed to inflate", KS_ERROR_ZLIB);
+                        return 0;
+                    }
+                    if (out_len < stage->buffer_size && !pipeline_push(pipe, step + 1, stage->buffer, stage->buffer_size - out_len))
+                    {
+                        return 0;
+                    }
+                    /* Output space left over means the inflater has nothing more to say about the input so far */
+                    if (out_len > 0 && (in_len == 0 || in == in_start))
+                    {
+                        break;
+                    }
+                }
+                return 1;
+            }
+            case KS_PROCESS_CUSTOM:
+                return pipeline_append(pipe, &stage->buffer, &stage->buffer_len, &stage->buffer_size, data, len);
+        }
+    }
+    return pipeline_append(pipe, &pipe->out, &pipe->out_len, &pipe->out_size, data, len);
+}
+
+/* Pushes the source through in blocks, so only the block being processed is copied */
+static ks_bool pipeline_run(ks_pipeline* pipe, const uint8_t* data, uint64_t len, int step)
+{
+    uint64_t block_size = min(len, KS_PROCESS_BLOCK_SIZE);
+    uint64_t pos;
+
+    /* The block comes from the arena and is shared by all runs, small inputs only take what they need */
+    if (block_size > pipe->block_size)
+    {
+        uint8_t* block = ks_realloc(pipe->config, pipe->block, block_size);
+        if (!block)
+        {
+            return 0;
+        }
+        pipe->block = block;
+        pipe->block_size = block_size;
+    }
+    for (pos = 0; pos < len; pos += KS_PROCESS_BLOCK_SIZE)
+    {
+        uint64_t count = min(len - pos, KS_PROCESS_BLOCK_SIZE);
+        memcpy(pipe->block, data + pos, count);
+        if (!pipeline_push(pipe, step, pipe->block, count))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Ends the stages in order, collected custom decoder input is decoded and passed on */
+static ks_bool pipeline_finish(ks_pipeline* pipe, ks_stream* stream)
+{
+    int step;
+    for (step = 0; step < pipe->count; step++)
+    {
+        ks_pipeline_stage* stage = &pipe->stages[step];
+        if (pipe->steps[step].type == KS_PROCESS_ZLIB && !stage->inflate_done)
+        {
+            KS_ERROR(pipe->config, "Compressed data is truncated", KS_ERROR_ZLIB);
+            return 0;
+        }
+        if (pipe->steps[step].type == KS_PROCESS_CUSTOM)
+        {
+            ks_custom_decoder* decoder = pipe->steps[step].decoder;
+            ks_bytes* input = bytes_create(stream);
+            ks_bytes* decoded;
+            const uint8_t* data;
+            uint64_t len;
+
+            if (!input)
+            {
+                return 0;
+            }
+            input->data_direct = stage->buffer;
+            input->length = stage->buffer_len;
+            decoded = decoder->decode(decoder->userdata, input);
+            if (!decoded || pipe->config->error)
+            {
+                if (!pipe->config->error)
+                {
+                    KS_ERROR(pipe->config, "Custom decoder failed", KS_ERROR_OTHER);
+                }
+                return 0;
+            }
+            data = ks_bytes_get_view(decoded, &len);
+            if (!data || !pipeline_run(pipe, data, len, step + 1))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+ks_bytes* ks_bytes_process_pipeline(ks_bytes* bytes, const ks_process_step* steps, int count)
+{
+    ks_stream* stream = HANDLE(bytes)->stream;
+    ks_bytes* ret = bytes_create(stream);
+    ks_pipeline pipe;
+    const uint8_t* data;
+    uint64_t len;
+    ks_bool success = 0;
+    int i;
+
+    if (!ret)
+    {
+        return 0;
+    }
+    data = ks_bytes_get_view(bytes, &len);
+    if (!data)
+    {
+        return 0;
+    }
+    memset(&pipe, 0, sizeof(ks_pipeline));
+    pipe.config = stream->config;
+    pipe.steps = steps;
+    pipe.count = count;
+    pipe.stages = ks_alloc(pipe.config, sizeof(ks_pipeline_stage) * max(count, 1));
+    if (!pipe.stages)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        ks_pipeline_stage* stage = &pipe.stages[i];
+        uint64_t j;
+        switch (steps[i].type)
+        {
+            case KS_PROCESS_XOR_INT:
+                stage->key_len = steps[i].count < 1 ? 1 : min(steps[i].count, 8);
+                for (j = 0; j < stage->key_len; j++)
+                {
+                    stage->key_int[j] = (uint8_t)(steps[i].xor_int >> (8 * (stage->key_len - 1 - j)));
+                }
+                stage->key = stage->key_int;
+                break;
+            case KS_PROCESS_XOR_BYTES:
+                stage->key = ks_bytes_get_view(steps[i].xor_bytes, &stage->key_len);
+                if (!stage->key)
+                {
+                    goto end;
+                }
+                break;
+            case KS_PROCESS_ZLIB:
+                /* Output is passed on block by block, compressed input rarely expands beyond four times */
+                stage->buffer_size = min(max(len * 4, 4096), KS_PROCESS_BLOCK_SIZE);
+                stage->buffer = ks_alloc(pipe.config, stage->buffer_size);
+                stage->inflate_state = stage->buffer ? config_inflate_begin(pipe.config) : 0;
+                if (!stage->inflate_state)
+                {
+                    goto end;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    pipe.out_size = max(len, 1);
+    pipe.out = ks_alloc(pipe.config, pipe.out_size);
+    success = pipe.out && pipeline_run(&pipe, data, len, 0) && pipeline_finish(&pipe, stream);
+
+end:
+    for (i = 0; i < count; i++)
+    {
+        if (pipe.stages[i].inflate_state)
+        {
+            config_inflate_end(pipe.config, pipe.stages[i].inflate_state);
+        }
+    }
+
+    if (!success)
     {
-        uint64_t b = ret->data_direct[i];
-        ret->data_direct[i] = (b << count) | (b >> (8 - count));
+        if (!pipe.config->error)
+        {
+            KS_ERROR(pipe.config, "Failed to process bytes", KS_ERROR_OTHER);
+        }
+        return 0;
     }
+    ret->data_direct = pipe.out;
+    ret->length = pipe.out_len;
     return ret;
 }
 
@@ -6,6 +6,8 @@ Usage:
 3) Create config with ks_config_init
 4) Create stream, e.g. ks_stream_create_from_file
 5) Read type: ksx_read_{TYPENAME}_from_stream;
+6) Call ks_config_reset before reading the next input with the same config,
+   this keeps the config's memory pages for reuse
 */
 
 #ifndef KAITAI_STRUCT_H
@@ -42,12 +44,60 @@ typedef enum ks_error
     KS_ERROR_VALIDATION_FAILED,
     KS_ERROR_ENDIANESS_UNSPECIFIED,
     KS_ERROR_REALLOC_FAILED,
+    KS_ERROR_MEMORY_LIMIT,
+    KS_ERROR_NEED_MORE_DATA,
 } ks_error;
 
 typedef struct ks_config ks_config;
 
+/* Streaming decompression used by ks_bytes_process_zlib and ks_bytes_process_pipeline. step consumes from *in and
+   writes to *out, advancing both, and sets *done at the end of the compressed data. The config keeps one state
+   around and calls reset before reusing it */
+typedef struct ks_inflater
+{
+    void* (*begin)(ks_config* config);
+    ks_error (*step)(void* state, const uint8_t** in, uint64_t* in_len, uint8_t** out, uint64_t* out_len, ks_bool* done);
+    ks_error (*reset)(void* state);
+    void (*end)(ks_config* config, void* state);
+} ks_inflater;
+
+/* Memory callbacks, alloc and realloc return uninitialized memory like malloc and realloc */
+typedef struct ks_allocator
+{
+    void* userdata;
+    void* (*alloc)(void* userdata, uint64_t size);
+    void* (*realloc)(void* userdata, void* data, uint64_t size);
+    void (*free)(void* userdata, void* data);
+} ks_allocator;
+
 static ks_config* ks_config_create(ks_log log);
+static ks_config* ks_config_create_with_allocator(ks_log log, const ks_allocator* allocator);
 void ks_config_destroy(ks_config* config);
+void ks_config_reset(ks_config* config);
+
+typedef struct ks_memory_stats
+{
+    uint64_t live_bytes; /* Bytes in blocks handed out since creation or the last reset */
+    uint64_t peak_bytes; /* Highest live_bytes seen over the lifetime of the config */
+    uint64_t reserved_bytes; /* Bytes held in memory pages, including unused space */
+    uint64_t alloc_count;
+    uint64_t realloc_count;
+} ks_memory_stats;
+
+/* Size of the read window file streams created afterwards load at once, shared with their substreams */
+void ks_config_set_file_window(ks_config* config, uint64_t size);
+
+/* File streams created afterwards ask the OS to load this many bytes ahead of sequential reads in the background,
+   0 (the default) disables it. POSIX only */
+void ks_config_set_readahead(ks_config* config, uint64_t size);
+
+/* Lets ks_stream_read_array point data straight into the buffer of memory streams when the element
+   endianness matches the host and the offset is aligned, copying otherwise. Such arrays must not be modified. */
+void ks_config_set_array_aliasing(ks_config* config, ks_bool enable);
+
+/* Reading fails with KS_ERROR_MEMORY_LIMIT once live_bytes would exceed limit, 0 means no limit */
+void ks_config_set_memory_limit(ks_config* config, uint64_t limit);
+void ks_config_get_memory_stats(ks_config* config, ks_memory_stats* stats);
 
 typedef struct ks_usertype_generic
 {
@@ -70,13 +120,53 @@ struct ks_string
 /* Public functions */
 
 ks_stream* ks_stream_create_from_file(FILE* file, ks_config* config);
-ks_stream* ks_stream_create_from_memory(uint8_t* data, int len, ks_config* config);
+ks_stream* ks_stream_create_from_memory(uint8_t* data, uint64_t len, ks_config* config);
+
+typedef enum ks_access_hint
+{
+    KS_ACCESS_NORMAL,
+    KS_ACCESS_SEQUENTIAL,
+    KS_ACCESS_RANDOM,
+    KS_ACCESS_WILLNEED,
+} ks_access_hint;
+
+/* Hints that the range will be read soon, e.g. for instances at known offsets. The OS loads it in the background */
+void ks_stream_prefetch(ks_stream* stream, uint64_t pos, uint64_t len);
+
+/* Reads with pread and keeps no file position, so several configs can share fd across threads. POSIX only */
+ks_stream* ks_stream_create_from_fd(int fd, ks_config* config);
+
+/* Maps the file into memory, the mapping lives until the config is reset or destroyed. POSIX only */
+ks_stream* ks_stream_create_from_path(const char* path, ks_config* config, ks_access_hint hint);
+
+/* Reads forward only, e.g. from stdin or a pipe. Only the data of the current read is buffered, seeking back before
+   it fails. The length is unknown until the end of file is reached */
+ks_stream* ks_stream_create_from_pipe(FILE* file, ks_config* config);
+
+/* Decompresses zlib data on demand into a window of ks_config_set_file_window size instead of inflating it at once.
+   Reads go forward like on a pipe, seeking back before the window decompresses again from the start */
+ks_stream* ks_stream_create_from_zlib(ks_bytes* bytes);
+
+/* Stream the caller pushes data into with ks_stream_feed, e.g. from a socket. It outlives ks_config_reset and is freed
+   with ks_stream_destroy or the config. Its length is unknown until ks_stream_feed_eof, reading past the data fed so
+   far fails with KS_ERROR_NEED_MORE_DATA. The next feed clears that error and rewinds to the last ks_stream_mark, also
+   after a ks_config_reset, so the record can be parsed again from its start. */
+ks_stream* ks_stream_create_incremental(ks_config* config);
+/* Frees an incremental stream, e.g. when its connection closes. Other streams live in the config's memory */
+void ks_stream_destroy(ks_stream* stream);
+void ks_stream_feed(ks_stream* stream, const uint8_t* data, uint64_t len);
+void ks_stream_feed_eof(ks_stream* stream);
+/* Sets the position parsing resumes from, data before it is released */
+void ks_stream_mark(ks_stream* stream);
 
 ks_bytes* ks_bytes_recreate(ks_bytes* original, void* data, uint64_t length);
 ks_bytes* ks_bytes_create(ks_config* config, void* data, uint64_t length);
 
 uint64_t ks_bytes_get_length(const ks_bytes* bytes);
 ks_error ks_bytes_get_data(const ks_bytes* bytes, void* data);
+/* Returns the bytes without copying, valid until the config is reset or destroyed. Bytes of file streams are read
+   into the arena on first use and kept there */
+const uint8_t* ks_bytes_get_view(ks_bytes* bytes, uint64_t* length);
 
 ks_string* ks_string_from_cstr(ks_config* config, const char* data);
 
@@ -85,6 +175,11 @@ void ks_string_set_error(ks_string* bytes, ks_error error);
 
 ks_config* ks_usertype_get_config(ks_usertype_generic* base);
 
+/* Untracked memory from the config's allocator, must be released with ks_scratch_free */
+void* ks_scratch_alloc(ks_config* config, uint64_t len);
+void* ks_scratch_realloc(ks_config* config, void* data, uint64_t len);
+void ks_scratch_free(ks_config* config, void* data);
+
 /* Typeinfo */
 
 typedef enum ks_type
@@ -211,9 +306,11 @@ typedef struct ks_array_usertype_generic
 
 /* Private functions */
 
-ks_config* ks_config_create_internal(ks_log log, ks_ptr_inflate inflate, ks_ptr_str_decode str_decode);
+ks_config* ks_config_create_internal(ks_log log, ks_ptr_inflate inflate, const ks_inflater* inflater, ks_ptr_str_decode str_decode, const ks_allocator* allocator);
 
 ks_handle* ks_handle_create(ks_stream* stream, void* data, ks_type type, int type_size, int internal_read_size, ks_usertype_generic* parent);
+/* Allocates a zeroed object of the given size with its handle and internal_read block in the same memory */
+void* ks_usertype_create(ks_stream* stream, int size, ks_type type, int type_size, int internal_read_size, ks_usertype_generic* parent);
 
 ks_stream* ks_stream_create_from_bytes(ks_bytes* bytes);
 ks_stream* ks_stream_get_root(ks_stream* stream);
@@ -242,13 +339,22 @@ double ks_stream_read_f8be(ks_stream* stream);
 
 uint64_t ks_stream_read_bits_le(ks_stream* stream, int width);
 uint64_t ks_stream_read_bits_be(ks_stream* stream, int width);
+/* Reads count bitfields of the given widths one after another into values */
+void ks_stream_read_bits_le_array(ks_stream* stream, const int* widths, uint64_t count, uint64_t* values);
+void ks_stream_read_bits_be_array(ks_stream* stream, const int* widths, uint64_t count, uint64_t* values);
 void ks_stream_align_to_byte(ks_stream* stream);
 
-ks_bytes* ks_stream_read_bytes(ks_stream* stream, int len);
+/* Fills a numeric ks_array_* created with its element type and size in one read, e.g. for repeated u4be */
+void ks_stream_read_array(ks_stream* stream, ks_usertype_generic* array, uint64_t count, ks_bool big_endian);
+
+ks_bytes* ks_stream_read_bytes(ks_stream* stream, uint64_t len);
 ks_bytes* ks_stream_read_bytes_term(ks_stream* stream, uint8_t terminator, ks_bool include, ks_bool consume, ks_bool eos_error);
+/* Terminator matches only at multiples of align from the start, 1 for delimiters like CRLF, 2 for UTF-16, 4 for UTF-32 */
+ks_bytes* ks_stream_read_bytes_term_multi(ks_stream* stream, ks_bytes* terminator, int align, ks_bool include, ks_bool consume, ks_bool eos_error);
 ks_bytes* ks_stream_read_bytes_full(ks_stream* stream);
 ks_bool ks_stream_is_eof(ks_stream* stream);
 uint64_t ks_stream_get_pos(ks_stream* stream);
+/* Pipe and zlib streams are read up to their end to find it */
 uint64_t ks_stream_get_length(ks_stream* stream);
 void ks_stream_seek(ks_stream* stream, uint64_t pos);
 
@@ -256,11 +362,39 @@ ks_bytes* ks_bytes_from_data(ks_config* config, uint64_t count, ...);
 ks_bytes* ks_bytes_from_data_terminated(ks_config* config, ...);
 ks_bytes* ks_array_min_bytes(ks_usertype_generic* array);
 ks_bytes* ks_array_max_bytes(ks_usertype_generic* array);
+/* strip_right and terminate return slices sharing the storage of their input */
 ks_bytes* ks_bytes_strip_right(ks_bytes* bytes, int pad);
 ks_bytes* ks_bytes_terminate(ks_bytes* bytes, int term, ks_bool include);
+ks_bytes* ks_bytes_terminate_multi(ks_bytes* bytes, ks_bytes* terminator, int align, ks_bool include);
 ks_bytes* ks_bytes_process_xor_int(ks_bytes* bytes, uint64_t xor_int, int count_xor_bytes);
 ks_bytes* ks_bytes_process_xor_bytes(ks_bytes* bytes, ks_bytes* xor_bytes);
 ks_bytes* ks_bytes_process_rotate_left(ks_bytes* bytes, int count);
+/* Inflates straight from the stream into the arena, size_hint is the expected output size or 0 if unknown */
+ks_bytes* ks_bytes_process_zlib(ks_bytes* bytes, uint64_t size_hint);
+
+typedef enum ks_process_type
+{
+    KS_PROCESS_XOR_INT,
+    KS_PROCESS_XOR_BYTES,
+    KS_PROCESS_ROTATE_LEFT,
+    KS_PROCESS_ZLIB,
+    KS_PROCESS_CUSTOM,
+} ks_process_type;
+
+/* One transform of ks_bytes_process_pipeline, only the fields of its type are used */
+typedef struct ks_process_step
+{
+    ks_process_type type;
+    uint64_t xor_int;
+    int count; /* Key bytes for XOR_INT, bits for ROTATE_LEFT */
+    ks_bytes* xor_bytes;
+    ks_custom_decoder* decoder;
+} ks_process_step;
+
+/* Applies the steps in order while passing the data through block by block into a single output buffer. Custom
+   decoders work on whole buffers, so the data reaching them is collected first. Returns 0 with the error set on
+   failure */
+ks_bytes* ks_bytes_process_pipeline(ks_bytes* bytes, const ks_process_step* steps, int count);
 int64_t ks_bytes_get_at(const ks_bytes* bytes, uint64_t index);
 
 ks_string* ks_string_concat(ks_string* s1, ks_string* s2);
@@ -268,7 +402,8 @@ ks_string* ks_string_from_int(ks_config* config, int64_t i, int base);
 int64_t ks_string_to_int(ks_string* str, int base);
 ks_string* ks_string_from_bytes(ks_bytes* bytes, ks_string* encoding);
 ks_string* ks_string_reverse(ks_string* str);
-ks_string* ks_string_substr(ks_string* str, int start, int end);
+/* The result is always null terminated, a suffix shares the storage of str. Out of range bounds set an error and return 0 */
+ks_string* ks_string_substr(ks_string* str, int64_t start, int64_t end);
 
 ks_array_int8_t* ks_array_int8_t_from_data(ks_config* config, uint64_t count, ...);
 ks_array_int16_t* ks_array_int16_t_from_data(ks_config* config, uint64_t count, ...);
@@ -304,11 +439,45 @@ int64_t ks_div(int64_t a, int64_t b);
 
 #ifdef KS_DEPEND_ON_INTERNALS
 
+typedef enum ks_source_type
+{
+    KS_SOURCE_FILE,
+    KS_SOURCE_FD,
+    KS_SOURCE_FEED,
+    KS_SOURCE_PIPE,
+    KS_SOURCE_ZLIB,
+} ks_source_type;
+
+#define KS_FILE_WINDOW_SIZE (64 * 1024)
+#define KS_LENGTH_UNKNOWN UINT64_MAX
+
+/* Backing storage of a non-memory stream, shared by the stream and its substreams */
+typedef struct ks_stream_source
+{
+    ks_source_type type;
+    FILE* file;
+    int fd;
+    uint64_t length;
+    uint8_t* window;
+    uint64_t window_size;
+    uint64_t window_start;
+    uint64_t window_length;
+    uint64_t mark; /* Fed streams only keep data from here on */
+    ks_bool starved; /* A fed stream ran out of data, the next feed rewinds to mark */
+    ks_bool eof;
+    uint64_t read_end;
+    uint64_t readahead_size;
+    uint64_t readahead_end;
+    const uint8_t* input; /* Compressed data of zlib streams */
+    uint64_t input_length;
+    uint64_t input_pos;
+    void* inflate_state;
+} ks_stream_source;
+
 struct ks_stream
 {
     ks_config* config;
-    ks_bool is_file;
-    FILE* file;
+    ks_stream_source* source;
     uint8_t* data;
     uint64_t start;
     uint64_t length;
@@ -323,7 +492,7 @@ struct ks_handle
     ks_stream* stream;
     void* internal_read;
     struct ks_usertype_generic* parent;
-    int pos;
+    uint64_t pos;
     void* data;
     ks_type type;
     int type_size;
@@ -339,25 +508,62 @@ struct ks_bytes
     uint8_t* data_direct;
 };
 
-#define KS_MAX_MEMINFO 100
-struct ks_memory_info
+/* Objects are carved from arena pages with a bump pointer and released all at once with the config */
+#define KS_MEMORY_PAGE_SIZE (64 * 1024)
+#define KS_MEMORY_ALIGN 16
+#define KS_MEMORY_ALIGN_UP(len) (((len) + KS_MEMORY_ALIGN - 1) & ~(uint64_t)(KS_MEMORY_ALIGN - 1))
+struct ks_memory_page
+{
+    struct ks_memory_page* prev;
+    struct ks_memory_page* next;
+    uint64_t size;
+    uint64_t used;
+};
+typedef struct ks_memory_page ks_memory_page;
+#define KS_MEMORY_PAGE_HEADER KS_MEMORY_ALIGN_UP(sizeof(ks_memory_page))
+
+/* Precedes every block, so ks_realloc finds the owning page without searching. The magic tells blocks apart from
+   memory inside them, e.g. the data of bytes created together with their handle */
+#define KS_MEMORY_BLOCK_MAGIC 0x6b73626cu
+struct ks_memory_block
 {
-    int count;
-    void* data[KS_MAX_MEMINFO];
-    struct ks_memory_info* next;
+    struct ks_memory_page* page;
+    uint64_t size;
+    uint32_t magic;
 };
-typedef struct ks_memory_info ks_memory_info;
+typedef struct ks_memory_block ks_memory_block;
+#define KS_MEMORY_BLOCK_HEADER KS_MEMORY_ALIGN_UP(sizeof(ks_memory_block))
+
+/* Alignment of the parts inside one ks_usertype_create block */
+#define KS_OBJECT_ALIGN_UP(len) (((len) + sizeof(uint64_t) - 1) & ~(uint64_t)(sizeof(uint64_t) - 1))
+
+/* Runs when the config is reset or destroyed, e.g. to unmap files */
+typedef struct ks_cleanup
+{
+    ks_callback func;
+    void* data;
+    struct ks_cleanup* next;
+} ks_cleanup;
 
 struct ks_config
 {
     ks_error error;
     ks_stream* fake_stream;
     ks_ptr_inflate inflate;
+    ks_inflater inflater;
     ks_ptr_str_decode str_decode;
     ks_log log;
-    struct ks_memory_info* meminfo_start;
-    struct ks_memory_info* meminfo_current;
-    void **meminfo_last_realloc;
+    ks_allocator allocator;
+    uint64_t file_window_size;
+    uint64_t readahead_size;
+    ks_bool array_aliasing;
+    ks_cleanup* cleanup;
+    ks_cleanup* cleanup_persistent;
+    void* inflate_state; /* Idle inflater state kept for reuse */
+    struct ks_memory_page* page_start;
+    struct ks_memory_page* page_current;
+    uint64_t memory_limit;
+    ks_memory_stats memory;
 };
 
 #endif
@@ -426,88 +632,216 @@ void* ks_realloc(ks_config* config, void* old, uint64_t len);
 
 #endif
 
+/* Inline readers */
+
+#ifdef KS_DEPEND_ON_INTERNALS
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KS_INLINE static __inline__
+#elif defined(_MSC_VER)
+#define KS_INLINE static __inline
+#else
+#define KS_INLINE static
+#endif
+
+#if defined(__BYTE_ORDER__)
+#define KS_HOST_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#else
+/* Compilers fold this to a constant as well */
+KS_INLINE ks_bool ks_host_big_endian(void)
+{
+    int n = 1;
+    return *(char*)&n == 0;
+}
+#define KS_HOST_BIG_ENDIAN ks_host_big_endian()
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KS_BSWAP16(x) __builtin_bswap16(x)
+#define KS_BSWAP32(x) __builtin_bswap32(x)
+#define KS_BSWAP64(x) __builtin_bswap64(x)
+#elif defined(_MSC_VER)
+#define KS_BSWAP16(x) _byteswap_ushort(x)
+#define KS_BSWAP32(x) _byteswap_ulong(x)
+#define KS_BSWAP64(x) _byteswap_uint64(x)
+#else
+#define KS_BSWAP16(x) ((uint16_t)((x) >> 8 | (x) << 8))
+#define KS_BSWAP32(x) ((uint32_t)KS_BSWAP16((uint16_t)(x)) << 16 | KS_BSWAP16((uint16_t)((x) >> 16)))
+#define KS_BSWAP64(x) ((uint64_t)KS_BSWAP32((uint32_t)(x)) << 32 | KS_BSWAP32((uint32_t)((x) >> 32)))
+#endif
+#define KS_BSWAP8(x) (x)
+
+/* Memory streams are read with a single load, everything else goes through the exported reader */
+#define KS_READ_INLINE(name, type, type_raw, bits, big_endian) \
+    KS_INLINE type ks_inline_read_##name(ks_stream* stream) \
+    { \
+        type_raw raw; \
+        type value; \
+        if (!stream->data || stream->pos + sizeof(raw) > stream->length) { \
+            return ks_stream_read_##name(stream); \
+        } \
+        memcpy(&raw, stream->data + stream->start + stream->pos, sizeof(raw)); \
+        stream->pos += sizeof(raw); \
+        if (big_endian != KS_HOST_BIG_ENDIAN) { \
+            raw = KS_BSWAP##bits(raw); \
+        } \
+        memcpy(&value, &raw, sizeof(value)); \
+        return value; \
+    }
+
+KS_READ_INLINE(u1, uint8_t, uint8_t, 8, 0)
+KS_READ_INLINE(u2le, uint16_t, uint16_t, 16, 0)
+KS_READ_INLINE(u4le, uint32_t, uint32_t, 32, 0)
+KS_READ_INLINE(u8le, uint64_t, uint64_t, 64, 0)
+KS_READ_INLINE(u2be, uint16_t, uint16_t, 16, 1)
+KS_READ_INLINE(u4be, uint32_t, uint32_t, 32, 1)
+KS_READ_INLINE(u8be, uint64_t, uint64_t, 64, 1)
+KS_READ_INLINE(s1, int8_t, uint8_t, 8, 0)
+KS_READ_INLINE(s2le, int16_t, uint16_t, 16, 0)
+KS_READ_INLINE(s4le, int32_t, uint32_t, 32, 0)
+KS_READ_INLINE(s8le, int64_t, uint64_t, 64, 0)
+KS_READ_INLINE(s2be, int16_t, uint16_t, 16, 1)
+KS_READ_INLINE(s4be, int32_t, uint32_t, 32, 1)
+KS_READ_INLINE(s8be, int64_t, uint64_t, 64, 1)
+KS_READ_INLINE(f4le, float, uint32_t, 32, 0)
+KS_READ_INLINE(f4be, float, uint32_t, 32, 1)
+KS_READ_INLINE(f8le, double, uint64_t, 64, 0)
+KS_READ_INLINE(f8be, double, uint64_t, 64, 1)
+
+/* Generated code calls the inline readers without changes, define KS_NO_INLINE_READS to opt out */
+#ifndef KS_NO_INLINE_READS
+#define ks_stream_read_u1(stream) ks_inline_read_u1(stream)
+#define ks_stream_read_u2le(stream) ks_inline_read_u2le(stream)
+#define ks_stream_read_u4le(stream) ks_inline_read_u4le(stream)
+#define ks_stream_read_u8le(stream) ks_inline_read_u8le(stream)
+#define ks_stream_read_u2be(stream) ks_inline_read_u2be(stream)
+#define ks_stream_read_u4be(stream) ks_inline_read_u4be(stream)
+#define ks_stream_read_u8be(stream) ks_inline_read_u8be(stream)
+#define ks_stream_read_s1(stream) ks_inline_read_s1(stream)
+#define ks_stream_read_s2le(stream) ks_inline_read_s2le(stream)
+#define ks_stream_read_s4le(stream) ks_inline_read_s4le(stream)
+#define ks_stream_read_s8le(stream) ks_inline_read_s8le(stream)
+#define ks_stream_read_s2be(stream) ks_inline_read_s2be(stream)
+#define ks_stream_read_s4be(stream) ks_inline_read_s4be(stream)
+#define ks_stream_read_s8be(stream) ks_inline_read_s8be(stream)
+#define ks_stream_read_f4le(stream) ks_inline_read_f4le(stream)
+#define ks_stream_read_f4be(stream) ks_inline_read_f4be(stream)
+#define ks_stream_read_f8le(stream) ks_inline_read_f8le(stream)
+#define ks_stream_read_f8be(stream) ks_inline_read_f8be(stream)
+#endif
+
+#endif
+
 /* Dynamic functions */
 
 #ifdef KS_USE_ZLIB
 #include <zlib.h>
 static ks_bytes* ks_inflate(ks_bytes* bytes)
 {
-    uint64_t length_in = ks_bytes_get_length(bytes);
-    uint8_t* data_in = 0;
-    uint8_t* data_out = 0;
-    uint64_t length_out = 0;
-    z_stream strm = {0};
-    uint8_t outbuffer[1024*64];
-    int ret_zlib;
-    ks_bytes* ret;
-    ks_error err;
+    return ks_bytes_process_zlib(bytes, 0);
+}
+
+/* zlib allocates its state and window through these, so they come from the config's allocator as well */
+static voidpf ks_zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+    return ks_scratch_alloc((ks_config*)opaque, (uint64_t)items * size);
+}
+
+static void ks_zlib_free(voidpf opaque, voidpf address)
+{
+    ks_scratch_free((ks_config*)opaque, address);
+}
 
-    data_in = (uint8_t*)malloc(length_in);
-    err = ks_bytes_get_data(bytes, data_in);
-    if (err != KS_ERROR_OKAY)
+static void* ks_inflate_begin(ks_config* config)
+{
+    z_stream* strm = (z_stream*)ks_scratch_alloc(config, sizeof(z_stream));
+    if (!strm)
     {
-        ks_bytes_set_error(bytes, KS_ERROR_ZLIB);
         return 0;
     }
+    memset(strm, 0, sizeof(z_stream));
+    strm->zalloc = ks_zlib_alloc;
+    strm->zfree = ks_zlib_free;
+    strm->opaque = config;
+    if (inflateInit(strm) != Z_OK)
+    {
+        ks_scratch_free(config, strm);
+        return 0;
+    }
+    return strm;
+}
 
-    if (inflateInit(&strm) != Z_OK)
-        goto error;
-
-    strm.next_in = (Bytef*)data_in;
-    strm.avail_in = length_in;
-
-    do {
-        strm.next_out = outbuffer;
-        strm.avail_out = sizeof(outbuffer);
+static ks_error ks_inflate_step(void* state, const uint8_t** in, uint64_t* in_len, uint8_t** out, uint64_t* out_len, ks_bool* done)
+{
+    z_stream* strm = (z_stream*)state;
+    int ret_zlib;
 
-        ret_zlib = inflate(&strm, 0);
+    strm->next_in = (Bytef*)*in;
+    strm->avail_in = (uInt)(*in_len > (uInt)-1 ? (uInt)-1 : *in_len);
+    strm->next_out = (Bytef*)*out;
+    strm->avail_out = (uInt)(*out_len > (uInt)-1 ? (uInt)-1 : *out_len);
 
-        if (length_out < strm.total_out) {
-            data_out = (uint8_t*)realloc(data_out, strm.total_out);
-            memcpy(data_out + length_out, outbuffer, strm.total_out - length_out);
-            length_out = strm.total_out;
-        }
-    } while (ret_zlib == Z_OK);
+    ret_zlib = inflate(strm, Z_NO_FLUSH);
 
-    if (ret_zlib != Z_STREAM_END)
-        goto error;
+    *in_len -= (const uint8_t*)strm->next_in - *in;
+    *in = (const uint8_t*)strm->next_in;
+    *out_len -= (uint8_t*)strm->next_out - *out;
+    *out = (uint8_t*)strm->next_out;
 
-    if (inflateEnd(&strm) != Z_OK)
-        goto error;
+    if (ret_zlib == Z_STREAM_END)
+    {
+        *done = 1;
+        return KS_ERROR_OKAY;
+    }
+    return ret_zlib == Z_OK || ret_zlib == Z_BUF_ERROR ? KS_ERROR_OKAY : KS_ERROR_ZLIB;
+}
 
-    ret = ks_bytes_recreate(bytes, data_out, length_out);
-    free(data_in);
-    free(data_out);
-    return ret;
+static ks_error ks_inflate_reset(void* state)
+{
+    return inflateReset((z_stream*)state) == Z_OK ? KS_ERROR_OKAY : KS_ERROR_ZLIB;
+}
 
- error:
-    free(data_in);
-    free(data_out);
-    ks_bytes_set_error(bytes, KS_ERROR_ZLIB);
-    return 0;
+static void ks_inflate_end(ks_config* config, void* state)
+{
+    inflateEnd((z_stream*)state);
+    ks_scratch_free(config, state);
 }
+
+static const ks_inflater ks_zlib_inflater = {ks_inflate_begin, ks_inflate_step, ks_inflate_reset, ks_inflate_end};
 #else
 static ks_bytes* ks_inflate(ks_bytes* bytes)
 {
     ks_bytes_set_error(bytes, KS_ERROR_ZLIB_MISSING);
     return 0;
 }
+
+static const ks_inflater ks_zlib_inflater = {0, 0, 0, 0};
 #endif
 
 #ifdef KS_USE_ICONV
 #include <iconv.h>
 #include <errno.h>
 static ks_string* ks_str_decode(ks_string* src, const char* src_enc) {
+    ks_config* config = ks_usertype_get_config(&src->kaitai_base);
     iconv_t cd = iconv_open("UTF-8", src_enc);
     size_t src_left = src->len;
     size_t dst_len = src->len * 2;
-    char* dst = (char*)calloc(1, dst_len + 1); /* Alloc one more for null terminator */
+    char* dst = (char*)ks_scratch_alloc(config, dst_len + 1); /* Alloc one more for null terminator */
     char* dst_ptr = dst;
     char* src_ptr = src->data;
     size_t dst_left = dst_len;
     size_t res = -1;
     ks_string* ret;
 
+    if (!dst) {
+        if (cd != (iconv_t) -1) {
+            iconv_close(cd);
+        }
+        ks_string_set_error(src, KS_ERROR_ICONV);
+        return src;
+    }
+    memset(dst, 0, dst_len + 1);
+
     if (cd == (iconv_t) -1) {
         if (errno == EINVAL) {
             ks_string_set_error(src, KS_ERROR_ICONV);
@@ -523,7 +857,7 @@ static ks_string* ks_str_decode(ks_string* src, const char* src_enc) {
                 size_t dst_used = dst_len - dst_left;
                 dst_left += dst_len;
                 dst_len += dst_len;
-                dst = (char*)realloc(dst, dst_len + 1); /* Alloc one more for null terminator */
+                dst = (char*)ks_scratch_realloc(config, dst, dst_len + 1); /* Alloc one more for null terminator */
                 dst_ptr = &dst[dst_used];
                 memset(dst_ptr, 0, dst_left + 1); /* Alloc one more for null terminator */
             } else {
@@ -536,8 +870,8 @@ static ks_string* ks_str_decode(ks_string* src, const char* src_enc) {
         ks_string_set_error(src, KS_ERROR_ICONV);
     }
 
-    ret = ks_string_from_cstr(ks_usertype_get_config(&src->kaitai_base), dst);
-    free(dst);
+    ret = ks_string_from_cstr(config, dst);
+    ks_scratch_free(config, dst);
     return ret;
 }
 #else
@@ -549,7 +883,12 @@ static ks_string* ks_str_decode(ks_string* src, const char* src_enc)
 
 static ks_config* ks_config_create(ks_log log)
 {
-    return ks_config_create_internal(log, ks_inflate, ks_str_decode);
+    return ks_config_create_internal(log, ks_inflate, &ks_zlib_inflater, ks_str_decode, 0);
+}
+
+static ks_config* ks_config_create_with_allocator(ks_log log, const ks_allocator* allocator)
+{
+    return ks_config_create_internal(log, ks_inflate, &ks_zlib_inflater, ks_str_decode, allocator);
 }
 
 #endif